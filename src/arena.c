@@ -0,0 +1,96 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#include "common.h"
+#include "arena.h"
+#include "utils.h"
+
+#include <stdlib.h>
+
+// big enough for the struct req and the strings of almost every
+// request.
+#define CHUNK_SIZE (8192)
+#define ALIGN (2 * sizeof(void *))
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t cap;
+	char data[] __attribute__((aligned(ALIGN)));
+};
+
+static struct arena_chunk *
+chunk_new(size_t cap, struct arena_chunk *next)
+{
+	struct arena_chunk *ret;
+
+	ret = xmalloc(sizeof(*ret) + cap);
+	ret->next = next;
+	ret->cap = cap;
+	return ret;
+}
+
+void
+arena_init(struct arena *self)
+{
+	self->chunk = chunk_new(CHUNK_SIZE, NULL);
+	self->used = 0;
+}
+
+void
+arena_destroy(struct arena *self)
+{
+	struct arena_chunk *next;
+
+	for (struct arena_chunk *c = self->chunk; c; c = next) {
+		next = c->next;
+		free(c);
+	}
+	self->chunk = NULL;
+	self->used = 0;
+}
+
+void *
+arena_alloc(struct arena *self, size_t size)
+{
+	void *ret;
+
+	size = (size + ALIGN - 1) & ~(ALIGN - 1);
+	if (unlikely(self->chunk->cap - self->used < size)) {
+		self->chunk = chunk_new(size > CHUNK_SIZE ? size : CHUNK_SIZE,
+					self->chunk);
+		self->used = 0;
+	}
+
+	ret = &self->chunk->data[self->used];
+	self->used += size;
+	return ret;
+}
+
+void *
+arena_calloc(struct arena *self, size_t size)
+{
+	return memset(arena_alloc(self, size), 0, size);
+}
+
+char *
+arena_strdup(struct arena *self, const char *s)
+{
+	size_t len;
+
+	len = strlen(s) + 1;
+	return memcpy(arena_alloc(self, len), s, len);
+}
+
+void
+arena_reset(struct arena *self)
+{
+	struct arena_chunk *next;
+
+	// the first chunk is the last in the list.
+	while (self->chunk->next) {
+		next = self->chunk->next;
+		free(self->chunk);
+		self->chunk = next;
+	}
+	self->used = 0;
+}
@@ -0,0 +1,36 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include "common.h"
+
+// a bump allocator for memory that lives exactly as long as one
+// request.  Allocating is a pointer bump, nothing is freed on its
+// own, and arena_reset frees everything at once when the reply has
+// been sent.  Each worker has one, so it is never shared between
+// threads.
+
+struct arena_chunk;
+
+struct arena {
+	// the chunk being allocated from; older ones follow it
+	struct arena_chunk *chunk;
+	size_t used;
+};
+
+void arena_init(struct arena *self);
+void arena_destroy(struct arena *self);
+
+// returns size bytes, aligned for any type.  exits on failure.
+void *arena_alloc(struct arena *self, size_t size);
+// as arena_alloc, but zeroed.
+void *arena_calloc(struct arena *self, size_t size);
+char *arena_strdup(struct arena *self, const char *s);
+
+// frees everything allocated since the arena was last reset.  The
+// first chunk is kept, so most requests never call malloc at all.
+void arena_reset(struct arena *self);
+
+#endif // _ARENA_H_
@@ -0,0 +1,160 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+
+// bench_gen fills a cnote db with a synthetic library, for
+// benchmarking without a real music collection.  Artist n is named
+// 'Artist %04d', their album m 'Album %04d-%02d' (1-based), and song
+// titles are made of a few common words, so there is something to
+// search for.  Each song also gets an empty file in the music dir,
+// as cnote drops the songs whose files are gone when it starts.
+#include "common.h"
+#include "db.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+static const int DEFAULT_ARTISTS = 500;
+static const int DEFAULT_ALBUMS = 4;
+static const int DEFAULT_TRACKS = 12;
+
+static const char INSERT_QUERY[] =
+	"INSERT OR REPLACE INTO music"
+	"    (path, title, artist, album, track, time, modified)"
+	"    VALUES (?, ?, ?, ?, ?, ?, ?)";
+
+static const char *const WORDS[] = {
+	"love", "night", "blue", "heart", "river", "fire", "dream", "road",
+	"summer", "rain", "light", "home", "gold", "city", "song", "stone",
+	"wild", "moon", "ghost", "time", "dance", "young", "black", "sky",
+};
+#define NWORDS (sizeof(WORDS)/sizeof(WORDS[0]))
+
+const char *program_name;
+
+// writes a title of 1 to 4 words into buf.
+static void
+make_title(char *buf, size_t len)
+{
+	int n;
+
+	buf[0] = '\0';
+	n = 1 + rand() % 4;
+	for (int i = 0; i < n; i++) {
+		const char *word = WORDS[rand() % NWORDS];
+		size_t used = strlen(buf);
+		snprintf(&buf[used], len - used, "%s%c%s", i ? " " : "",
+			 i ? word[0] : word[0] - 'a' + 'A', &word[1]);
+	}
+}
+
+// creates an empty file at path under music, with the same
+// modification time as its row, so that cnote has no reason to read
+// it.
+static void
+make_stub(const char *music, const char *path, time_t modified)
+{
+	struct utimbuf times;
+	char full[512];
+	int fd;
+
+	snprintf(full, sizeof(full), "%s/%s", music, path);
+	fd = open(full, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		exit_perr("%s: open '%s'", program_name, full);
+	close(fd);
+
+	times.actime = modified;
+	times.modtime = modified;
+	if (utime(full, &times))
+		exit_perr("%s: utime '%s'", program_name, full);
+}
+
+int
+main(int argc, char *const argv[])
+{
+	int err, nartists, nalbums, ntracks;
+	char path[256], title[128], artist[32], album[32], dir[512];
+	const char *music;
+	sqlite3_stmt *stmt;
+	sqlite3 *db;
+	time_t now;
+
+	program_name = argv[0];
+
+	if (argc < 3 || argc > 6) {
+		fprintf(stderr, "usage: %s DB MUSIC [ARTISTS [ALBUMS [TRACKS]]]\n"
+			"  fills DB with ARTISTS artists (default: %d), each "
+			"with ALBUMS albums\n  (default: %d) of TRACKS tracks "
+			"(default: %d), and MUSIC with an empty\n  file for "
+			"each song.\n", program_name, DEFAULT_ARTISTS,
+			DEFAULT_ALBUMS, DEFAULT_TRACKS);
+		return EXIT_FAILURE;
+	}
+	music = argv[2];
+	nartists = argc > 3 ? atoi(argv[3]) : DEFAULT_ARTISTS;
+	nalbums = argc > 4 ? atoi(argv[4]) : DEFAULT_ALBUMS;
+	ntracks = argc > 5 ? atoi(argv[5]) : DEFAULT_TRACKS;
+	if (nartists < 1 || nalbums < 1 || ntracks < 1)
+		exit_msg("%s: counts must be positive", program_name);
+
+	err = sqlite3_open(argv[1], &db);
+	if (err != SQLITE_OK)
+		exit_msg("%s: couldn't open db '%s'", program_name, argv[1]);
+
+	db_create(db);
+	PREPARE_QUERY(db, INSERT_QUERY, &stmt);
+
+	// the same library every time
+	srand(1969);
+	now = time(NULL);
+
+	sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+	for (int a = 1; a <= nartists; a++) {
+		snprintf(artist, sizeof(artist), "Artist %04d", a);
+		for (int b = 1; b <= nalbums; b++) {
+			snprintf(album, sizeof(album), "Album %04d-%02d", a, b);
+			snprintf(dir, sizeof(dir), "%s/%s/%s", music, artist,
+				 album);
+			if (mkdirr(dir, 0755))
+				exit_msg("%s: couldn't create '%s'",
+					 program_name, dir);
+			for (int t = 1; t <= ntracks; t++) {
+				make_title(title, sizeof(title));
+				snprintf(path, sizeof(path), "%s/%s/%02d %s.mp3",
+					 artist, album, t, title);
+				make_stub(music, path, now);
+
+				sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+				sqlite3_bind_text(stmt, 2, title, -1, SQLITE_STATIC);
+				sqlite3_bind_text(stmt, 3, artist, -1, SQLITE_STATIC);
+				sqlite3_bind_text(stmt, 4, album, -1, SQLITE_STATIC);
+				sqlite3_bind_int(stmt, 5, t);
+				sqlite3_bind_int(stmt, 6, 120 + rand() % 300);
+				sqlite3_bind_int64(stmt, 7, now);
+
+				err = sqlite3_step(stmt);
+				if (err != SQLITE_DONE)
+					exit_msg("insert failed: %d - %s", err,
+						 sqlite3_errmsg(db));
+				sqlite3_reset(stmt);
+			}
+		}
+	}
+	db_rebuild_groups(db);
+	err = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+	if (err != SQLITE_OK)
+		exit_msg("commit failed: %d - %s", err, sqlite3_errmsg(db));
+
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+
+	printf("%s: %d artists, %d albums, %d songs\n", argv[1], nartists,
+	       nartists * nalbums, nartists * nalbums * ntracks);
+	return 0;
+}
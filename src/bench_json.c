@@ -0,0 +1,251 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+
+// bench_json times the response formats (JSON in json.c, and
+// MessagePack in msgpack.c) on their own, without sqlite or libevent
+// in the way: escaping strings, and writing rows both into a reused
+// buffer and as whole responses in a new one.  It reports nanoseconds
+// per row and throughput for each shape of row below.
+#include "common.h"
+#include "format.h"
+#include "json.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static const int DEFAULT_ROWS = 10000;
+// run each benchmark for at least this long
+static const double MIN_SECS = 0.25;
+
+#define NS_PER_SEC (1000000000ULL)
+
+const char *program_name;
+
+// rows shaped like those in real libraries
+static const struct {
+	const char *name;
+	struct song_row song;
+} SHAPES[] = {
+	{"short ascii", {
+		"Home", "Artist 0001", "Album 0001-01",
+		"Artist 0001/Album 0001-01/03 Home.mp3", 3, 187,
+	}},
+	{"typical", {
+		"Don't Stop Me Now", "Queen", "Jazz (2011 Remaster)",
+		"/home/bobby/Music/Queen/Jazz (2011 Remaster)/"
+		"12 Don't Stop Me Now.flac", 12, 209,
+	}},
+	{"non-ascii", {
+		"Jóga", "Björk", "Homogenic",
+		"/home/bobby/Music/Björk/Homogenic/02 Jóga.mp3", 2, 305,
+	}},
+	{"long, quoted", {
+		"Symphony No. 9 in D minor, Op. 125 \"Choral\": IV. Presto - "
+		"Allegro assai - Allegro assai vivace (alla marcia) & Andante",
+		"Berliner Philharmoniker; Herbert von Karajan",
+		"Beethoven: The 9 Symphonies [Disc 6] (Remastered 1963 Recording)",
+		"/home/bobby/Music/Berliner Philharmoniker; Herbert von Karajan/"
+		"Beethoven: The 9 Symphonies [Disc 6]/04 Symphony No. 9 in D "
+		"minor, Op. 125 \"Choral\": IV. Presto.flac", 4, 1456,
+	}},
+	{"bad bytes", {
+		"Tab\there \"and\" \\there\r\n", "Mot\xf6rhead", "Ace of Spades",
+		"/home/bobby/Music/Mot\xf6rhead/Ace of Spades/01 \x01.mp3", 1, 169,
+	}},
+};
+#define NSHAPES (sizeof(SHAPES)/sizeof(SHAPES[0]))
+
+static const char *const FORMAT_NAMES[RESP_MAX] = {
+	[RESP_JSON] = "json",
+	[RESP_MSGPACK] = "msgpack",
+};
+
+// keeps the compiler from optimizing away the work being timed
+static volatile size_t sink;
+// the shape being benchmarked
+static const char *shape_name;
+static const struct song_row *shape;
+// whether it is written as a song, or just the artist name
+static bool song;
+// the format it is written in
+static enum RESP_KIND kind;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static size_t
+shape_len(void)
+{
+	if (!song)
+		return strlen(shape->artist);
+	return strlen(shape->title) + strlen(shape->artist) +
+		strlen(shape->album) + strlen(shape->path);
+}
+
+static void
+shape_write(struct wbuf *out)
+{
+	if (song)
+		formats[kind]->song(out, shape);
+	else
+		formats[kind]->string(out, shape->artist);
+}
+
+static void
+report(const char *what, uint64_t ns, size_t rows, size_t bytes)
+{
+	double secs = (double)ns / NS_PER_SEC;
+	char name[64];
+
+	snprintf(name, sizeof(name), "%s %s", FORMAT_NAMES[kind], what);
+	printf("%-14s %-27s %10.1f %10.1f\n", song ? shape_name :
+	       "artist names", name, (double)ns / rows,
+	       bytes / secs / (1024 * 1024));
+}
+
+// runs fn(nrows) until MIN_SECS have passed, and reports the average
+// time per row.  fn returns the bytes it produced.
+typedef size_t (*bench_fn)(int nrows);
+
+static void
+bench(const char *what, bench_fn fn, int nrows)
+{
+	uint64_t start, elapsed;
+	size_t done, bytes;
+
+	done = 0;
+	bytes = 0;
+	start = now_ns();
+	do {
+		bytes += fn(nrows);
+		done += nrows;
+		elapsed = now_ns() - start;
+	} while (elapsed < MIN_SECS * NS_PER_SEC);
+
+	report(what, elapsed, done, bytes);
+}
+
+// the strings alone, escaped into a buffer that is reused; counts
+// the unescaped input bytes.
+static size_t
+bench_strings(int nrows)
+{
+	static struct wbuf out;
+	const struct format_ops *fmt = formats[kind];
+
+	if (!out.buf)
+		wbuf_init(&out, 0);
+
+	for (int i = 0; i < nrows; i++) {
+		out.len = 0;
+		fmt->string(&out, shape->artist);
+		if (song) {
+			fmt->string(&out, shape->title);
+			fmt->string(&out, shape->album);
+			fmt->string(&out, shape->path);
+		}
+	}
+	sink += out.len;
+
+	return nrows * shape_len();
+}
+
+// rows as they are streamed, a row at a time into a reused buffer.
+static size_t
+bench_rows(int nrows)
+{
+	static struct wbuf out;
+	size_t bytes = 0;
+
+	if (!out.buf)
+		wbuf_init(&out, 0);
+
+	for (int i = 0; i < nrows; i++) {
+		out.len = 0;
+		formats[kind]->list_item(&out, i);
+		shape_write(&out);
+		bytes += out.len;
+	}
+	sink += bytes;
+
+	return bytes;
+}
+
+// a whole list, as a cached response is built: into a new buffer
+// that grows to fit.
+static size_t
+bench_list(int nrows)
+{
+	const struct format_ops *fmt = formats[kind];
+	struct wbuf out;
+	size_t len, mark;
+	char *buf;
+
+	wbuf_init(&out, 0);
+	mark = fmt->list_start(&out, nrows);
+	for (int i = 0; i < nrows; i++) {
+		fmt->list_item(&out, i);
+		shape_write(&out);
+	}
+	fmt->list_end(&out, mark, nrows);
+
+	buf = wbuf_release(&out);
+	len = out.len;
+	sink += buf[len - 1];
+	free(buf);
+
+	return len;
+}
+
+static void
+bench_shape(int nrows)
+{
+	for (kind = 0; kind < RESP_MAX; kind++) {
+		bench("strings", bench_strings, nrows);
+		bench("rows, reused buffer", bench_rows, nrows);
+		bench("list, new buffer", bench_list, nrows);
+	}
+}
+
+int
+main(int argc, char *const argv[])
+{
+	int nrows;
+
+	program_name = argv[0];
+
+	if (argc > 2) {
+		fprintf(stderr, "usage: %s [ROWS]\n  times serializing lists "
+			"of ROWS rows (default: %d).\n", program_name,
+			DEFAULT_ROWS);
+		return EXIT_FAILURE;
+	}
+	nrows = argc > 1 ? atoi(argv[1]) : DEFAULT_ROWS;
+	if (nrows < 1)
+		exit_msg("%s: ROWS must be positive", program_name);
+
+	printf("%d rows per list; MiB/s is of input for strings, "
+	       "output otherwise\n", nrows);
+	printf("%-14s %-27s %10s %10s\n", "shape", "routine", "ns/row",
+	       "MiB/s");
+	song = true;
+	for (size_t i = 0; i < NSHAPES; i++) {
+		shape_name = SHAPES[i].name;
+		shape = &SHAPES[i].song;
+		bench_shape(nrows);
+	}
+	song = false;
+	shape = &SHAPES[1].song;
+	bench_shape(nrows);
+
+	return 0;
+}
@@ -0,0 +1,327 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+
+// bench_load is an HTTP load generator for cnote.  It keeps a number
+// of keep-alive connections busy for a while, each asking for the
+// given paths in turn, and then reports the throughput and latency
+// percentiles for each path.
+#include "common.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+
+static const char *DEFAULT_ADDR = "127.0.0.1";
+static const int DEFAULT_PORT = 1969;
+static const int DEFAULT_CONNS = 32;
+static const int DEFAULT_THREADS = 2;
+static const double DEFAULT_SECONDS = 10;
+
+#define NS_PER_SEC (1000000000ULL)
+#define NS_PER_MS (1000000.0)
+
+const char *program_name;
+
+// what one thread saw for one path
+struct result {
+	uint64_t *lat;
+	size_t len;
+	size_t cap;
+	uint64_t bytes;
+	int errors;
+};
+
+struct client;
+
+struct conn {
+	struct client *client;
+	struct evhttp_connection *evcon;
+	// the path being requested, and when it was sent
+	int path;
+	uint64_t sent;
+};
+
+// each thread runs an event loop driving its share of the connections.
+struct client {
+	pthread_t tinfo;
+	struct event_base *base;
+	struct conn *conns;
+	int nconns;
+	int active;
+	struct result *results;
+};
+
+static const char *addr;
+static int port;
+static char *const *paths;
+static int npaths;
+static bool gzip;
+static uint64_t deadline;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static void
+result_add(struct result *self, uint64_t lat)
+{
+	if (self->len == self->cap) {
+		self->cap = self->cap ? self->cap * 2 : 1024;
+		self->lat = realloc(self->lat, self->cap * sizeof(*self->lat));
+		if (!self->lat)
+			exit_perr("realloc");
+	}
+	self->lat[self->len++] = lat;
+}
+
+static void conn_send(struct conn *self);
+
+static void
+conn_done(struct evhttp_request *req, void *arg)
+{
+	struct conn *self = arg;
+	struct result *result;
+
+	result = &self->client->results[self->path];
+	if (!req || evhttp_request_get_response_code(req) / 100 != 2) {
+		result->errors++;
+	} else {
+		result_add(result, now_ns() - self->sent);
+		result->bytes += evbuffer_get_length(
+			evhttp_request_get_input_buffer(req));
+	}
+
+	self->path = (self->path + 1) % npaths;
+	if (now_ns() < deadline) {
+		conn_send(self);
+		return;
+	}
+
+	if (--self->client->active == 0)
+		event_base_loopexit(self->client->base, NULL);
+}
+
+static void
+conn_send(struct conn *self)
+{
+	struct evhttp_request *req;
+	struct evkeyvalq *headers;
+
+	req = evhttp_request_new(conn_done, self);
+	if (!req)
+		exit_msg("evhttp_request_new failed");
+
+	headers = evhttp_request_get_output_headers(req);
+	evhttp_add_header(headers, "Host", addr);
+	if (gzip)
+		evhttp_add_header(headers, "Accept-Encoding", "gzip");
+
+	self->sent = now_ns();
+	if (evhttp_make_request(self->evcon, req, EVHTTP_REQ_GET,
+				paths[self->path]))
+		exit_msg("evhttp_make_request failed");
+}
+
+static void *
+client_routine(struct client *self)
+{
+	for (int i = 0; i < self->nconns; i++)
+		conn_send(&self->conns[i]);
+
+	event_base_dispatch(self->base);
+
+	for (int i = 0; i < self->nconns; i++)
+		evhttp_connection_free(self->conns[i].evcon);
+	event_base_free(self->base);
+	return NULL;
+}
+
+static void
+client_init(struct client *self, int nconns, int first)
+{
+	self->base = event_base_new();
+	if (!self->base)
+		exit_perr("event_base_new");
+
+	self->nconns = nconns;
+	self->active = nconns;
+	self->conns = xcalloc(nconns * sizeof(*self->conns));
+	self->results = xcalloc(npaths * sizeof(*self->results));
+
+	for (int i = 0; i < nconns; i++) {
+		struct conn *conn = &self->conns[i];
+		conn->client = self;
+		// spread the connections across the paths
+		conn->path = (first + i) % npaths;
+		conn->evcon = evhttp_connection_base_new(self->base, NULL,
+							 addr, port);
+		if (!conn->evcon)
+			exit_msg("evhttp_connection_base_new failed");
+	}
+}
+
+static int
+u64_cmp(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *)a;
+	uint64_t ub = *(const uint64_t *)b;
+	return ua < ub ? -1 : ua > ub;
+}
+
+static double
+percentile(const struct result *self, double p)
+{
+	size_t i;
+
+	if (!self->len)
+		return 0;
+	i = p * self->len;
+	if (i >= self->len)
+		i = self->len - 1;
+	return self->lat[i] / NS_PER_MS;
+}
+
+static void
+report_line(const char *name, struct result *r, double secs)
+{
+	qsort(r->lat, r->len, sizeof(*r->lat), u64_cmp);
+	printf("%-32.32s %9zu %9.0f %8.3f %8.3f %8.3f %8.2f %6d\n", name,
+	       r->len, r->len / secs, percentile(r, 0.5),
+	       percentile(r, 0.99), percentile(r, 0.999),
+	       r->bytes / secs / (1024 * 1024), r->errors);
+}
+
+// merges every thread's results for each path, and prints them.
+static int
+report(struct client *clients, int nthreads, double secs)
+{
+	struct result total;
+	int errors;
+
+	memset(&total, 0, sizeof(total));
+	errors = 0;
+
+	printf("%-32s %9s %9s %8s %8s %8s %8s %6s\n", "path", "requests",
+	       "req/s", "p50 ms", "p99 ms", "p999 ms", "MiB/s", "errors");
+
+	for (int p = 0; p < npaths; p++) {
+		struct result merged;
+		memset(&merged, 0, sizeof(merged));
+		for (int t = 0; t < nthreads; t++) {
+			struct result *r = &clients[t].results[p];
+			for (size_t i = 0; i < r->len; i++) {
+				result_add(&merged, r->lat[i]);
+				result_add(&total, r->lat[i]);
+			}
+			merged.bytes += r->bytes;
+			merged.errors += r->errors;
+		}
+		total.bytes += merged.bytes;
+		total.errors += merged.errors;
+		errors += merged.errors;
+		report_line(paths[p], &merged, secs);
+		free(merged.lat);
+	}
+	report_line("total", &total, secs);
+	free(total.lat);
+
+	return errors;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-a ADDR] [-p PORT] [-c CONNS] "
+		"[-t THREADS] [-d SECONDS] [-z] PATH...\n"
+		"  requests each PATH in turn on CONNS keep-alive "
+		"connections (default: %d),\n  spread across THREADS "
+		"threads (default: %d), for SECONDS (default: %.0f).\n"
+		"  -z asks for gzipped responses.\n", program_name,
+		DEFAULT_CONNS, DEFAULT_THREADS, DEFAULT_SECONDS);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *const argv[])
+{
+	struct client *clients;
+	int optc, nconns, nthreads, err;
+	uint64_t start;
+	double secs;
+
+	program_name = argv[0];
+	addr = DEFAULT_ADDR;
+	port = DEFAULT_PORT;
+	nconns = DEFAULT_CONNS;
+	nthreads = DEFAULT_THREADS;
+	secs = DEFAULT_SECONDS;
+
+	while ((optc = getopt(argc, argv, "a:p:c:t:d:z")) != -1) {
+		switch (optc) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'c':
+			nconns = atoi(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'd':
+			secs = atof(optarg);
+			break;
+		case 'z':
+			gzip = true;
+			break;
+		default:
+			usage();
+		}
+	}
+	paths = &argv[optind];
+	npaths = argc - optind;
+	if (npaths < 1 || nconns < 1 || nthreads < 1 || secs <= 0)
+		usage();
+	if (nthreads > nconns)
+		nthreads = nconns;
+
+	clients = xcalloc(nthreads * sizeof(*clients));
+	for (int i = 0; i < nthreads; i++) {
+		int n = nconns / nthreads + (i < nconns % nthreads);
+		client_init(&clients[i], n, i * nconns / nthreads);
+	}
+
+	start = now_ns();
+	deadline = start + secs * NS_PER_SEC;
+	for (int i = 0; i < nthreads; i++) {
+		err = pthread_create(&clients[i].tinfo, NULL,
+				     (pthread_routine)client_routine,
+				     &clients[i]);
+		if (err)
+			exit_msg("pthread_create: %d", err);
+	}
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(clients[i].tinfo, NULL);
+
+	// requests in flight at the deadline finish after it.
+	secs = (double)(now_ns() - start) / NS_PER_SEC;
+	printf("%d connections, %d threads, %.1f seconds\n", nconns,
+	       nthreads, secs);
+
+	return report(clients, nthreads, secs) ? EXIT_FAILURE : 0;
+}
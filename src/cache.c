@@ -0,0 +1,164 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#include "common.h"
+#include "cache.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include <event2/buffer.h>
+#include <event2/http.h>
+
+
+struct response *
+response_new(char *data, size_t len, enum RESP_ENCODING encoding)
+{
+	struct response *ret;
+
+	ret = xmalloc(sizeof(*ret));
+	ret->refs = 1;
+	ret->encoding = encoding;
+	ret->len = len;
+	ret->data = data;
+
+	return ret;
+}
+
+void
+response_ref(struct response *self)
+{
+	__atomic_add_fetch(&self->refs, 1, __ATOMIC_RELAXED);
+}
+
+void
+response_unref(struct response *self)
+{
+	if (__atomic_sub_fetch(&self->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	free(self->data);
+	free(self);
+}
+
+static void
+response_cleanup_cb(const void *data __unused, size_t len __unused,
+		    void *extra)
+{
+	response_unref(extra);
+}
+
+void
+response_add_to(struct response *self, struct evbuffer *buf)
+{
+	response_ref(self);
+	if (evbuffer_add_reference(buf, self->data, self->len,
+				   response_cleanup_cb, self))
+		exit_msg("%s: evbuffer_add_reference failed", __func__);
+}
+
+struct response *
+resp_cache_get(struct resp_cache *self, enum RESP_KIND kind,
+	       enum RESP_LAYOUT layout, enum RESP_ENCODING encoding)
+{
+	struct response *ret;
+
+	// entries are only dropped once nobody can reach self, so
+	// there is no window between the load and the ref.
+	ret = __atomic_load_n(&self->slots[kind][layout][encoding],
+			      __ATOMIC_ACQUIRE);
+	if (ret)
+		response_ref(ret);
+
+	return ret;
+}
+
+struct response *
+resp_cache_set(struct resp_cache *self, enum RESP_KIND kind,
+	       enum RESP_LAYOUT layout, enum RESP_ENCODING encoding,
+	       struct response *resp)
+{
+	struct response *expected;
+
+	// the cache's reference
+	response_ref(resp);
+
+	expected = NULL;
+	if (__atomic_compare_exchange_n(&self->slots[kind][layout][encoding],
+					&expected, resp,
+					false, __ATOMIC_ACQ_REL,
+					__ATOMIC_ACQUIRE))
+		return resp;
+
+	// another thread built the same response first, so use theirs.
+	response_unref(resp);
+	response_unref(resp);
+	response_ref(expected);
+
+	return expected;
+}
+
+void
+resp_cache_copy(struct resp_cache *self, struct resp_cache *src)
+{
+	struct response **dst, **slots;
+
+	dst = &self->slots[0][0][0];
+	slots = &src->slots[0][0][0];
+	for (int i = 0; i < RESP_MAX * LAYOUT_MAX * ENC_MAX; i++) {
+		dst[i] = __atomic_load_n(&slots[i], __ATOMIC_ACQUIRE);
+		if (dst[i])
+			response_ref(dst[i]);
+	}
+}
+
+void
+resp_cache_clear(struct resp_cache *self)
+{
+	struct response **slots;
+
+	slots = &self->slots[0][0][0];
+	for (int i = 0; i < RESP_MAX * LAYOUT_MAX * ENC_MAX; i++) {
+		if (slots[i])
+			response_unref(slots[i]);
+		slots[i] = NULL;
+	}
+}
+
+bool
+etag_match(struct evhttp_request *req, enum RESP_KIND kind,
+	   enum RESP_LAYOUT layout, uint64_t generation)
+{
+	static const char *const KIND_SUFFIX[RESP_MAX] = {
+		[RESP_JSON] = "",
+		[RESP_MSGPACK] = "-mp",
+	};
+	static const char *const LAYOUT_SUFFIX[LAYOUT_MAX] = {
+		[LAYOUT_ROWS] = "",
+		[LAYOUT_COLUMNS] = "-col",
+	};
+	struct evkeyvalq *headers;
+	const char *if_none_match;
+	char etag[32];
+
+	// weak, because the same generation can be sent with different
+	// encodings.  Formats and layouts are different documents
+	// though, so they get different tags.
+	snprintf(etag, sizeof(etag), "W/\"%" PRIx64 "%s%s\"", generation,
+		 KIND_SUFFIX[kind], LAYOUT_SUFFIX[layout]);
+
+	headers = evhttp_request_get_output_headers(req);
+	evhttp_add_header(headers, "ETag", etag);
+	// still cacheable, but always check back with us first
+	evhttp_add_header(headers, "Cache-Control", "no-cache");
+
+	headers = evhttp_request_get_input_headers(req);
+	if_none_match = evhttp_find_header(headers, "If-None-Match");
+	if (!if_none_match)
+		return false;
+
+	// weak comparison: only the quoted part has to match.
+	return strstr(if_none_match, &etag[2]) != NULL ||
+		strcmp(if_none_match, "*") == 0;
+}
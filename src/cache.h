@@ -0,0 +1,62 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include "common.h"
+
+struct evbuffer;
+struct evhttp_request;
+
+// a finished response body.  Refcounted, so that a body can be
+// handed to libevent without copying and stay alive until it has
+// been sent, even if the cache it came from has since been dropped.
+struct response {
+	int refs;
+	enum RESP_ENCODING encoding;
+	size_t len;
+	char *data;
+};
+
+// the responses generated from an immutable catalog object, in each
+// encoding, built the first time they are asked for.  Since what
+// they were generated from never changes, entries never need to be
+// invalidated: the indexer publishing a new version of an artist or
+// album is what makes them go away.
+struct resp_cache {
+	struct response *slots[RESP_MAX][LAYOUT_MAX][ENC_MAX];
+};
+
+// takes ownership of data, which must have been malloc'ed.
+struct response *response_new(char *data, size_t len,
+			      enum RESP_ENCODING encoding);
+void response_ref(struct response *self);
+void response_unref(struct response *self);
+// adds self to buf without copying, holding a reference until
+// libevent is done with it.
+void response_add_to(struct response *self, struct evbuffer *buf);
+
+// returns a new reference to the cached response, or NULL.
+struct response *resp_cache_get(struct resp_cache *self, enum RESP_KIND kind,
+				enum RESP_LAYOUT layout,
+				enum RESP_ENCODING encoding);
+// caches resp unless another thread got there first, and returns a
+// reference to whichever is cached.  consumes the caller's
+// reference to resp.
+struct response *resp_cache_set(struct resp_cache *self, enum RESP_KIND kind,
+				enum RESP_LAYOUT layout,
+				enum RESP_ENCODING encoding,
+				struct response *resp);
+// copies every entry of src into self, for a new version of an
+// object whose responses are unchanged.
+void resp_cache_copy(struct resp_cache *self, struct resp_cache *src);
+void resp_cache_clear(struct resp_cache *self);
+
+// sets req's ETag from generation and the format and layout of the
+// response, and returns true if the client sent it back in
+// If-None-Match, meaning its copy is current.
+bool etag_match(struct evhttp_request *req, enum RESP_KIND kind,
+		enum RESP_LAYOUT layout, uint64_t generation);
+
+#endif // _CACHE_H_
@@ -0,0 +1,529 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#include "common.h"
+#include "catalog.h"
+#include "metrics.h"
+#include "utils.h"
+#include "db.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <glib.h>
+
+// while crawling, publish a new snapshot every this many changes
+// rather than waiting for the indexer to go idle.
+#define PUBLISH_BATCH (1024)
+// how far the starting generation is shifted left of the start time.
+// leaves room for a million changes per second of uptime before a
+// restart could reuse a generation.
+#define GENERATION_SHIFT (20)
+
+static const char LOAD_QUERY[] =
+	"SELECT path, title, artist, album, track, time, artist_id, album_id"
+	"    FROM music";
+
+// a group in the working copy.  published is the snapshot version of
+// this group, or NULL if a song has been added or removed since the
+// last catalog_publish.
+struct wgroup {
+	int64_t id;
+	char *name;
+	GPtrArray *songs;
+	struct cat_group *published;
+};
+
+typedef int (*song_cmp)(const void *a, const void *b);
+
+// current is the latest snapshot, and holds a reference of its own
+// until it is replaced.  published counts the times it has been, so
+// that each reader thread can keep a reference to the snapshot it saw
+// last (cached) and only takes current_lock to swap it for a new one.
+static pthread_mutex_t current_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct catalog *current;
+static uint64_t published;
+static __thread struct catalog *cached;
+static __thread uint64_t cached_published;
+
+// the working copy, only touched by the indexer thread (and by main,
+// before the indexer is started).
+static GHashTable *songs;   // path -> struct cat_song
+static GHashTable *artists; // name -> struct wgroup
+static GHashTable *albums;  // name -> struct wgroup
+static struct names *artist_names;
+static struct names *album_names;
+static int pending;
+static uint64_t generation;
+
+static void
+song_unref(struct cat_song *self)
+{
+	if (__atomic_sub_fetch(&self->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	free(self->path);
+	free(self->title);
+	free(self->artist);
+	free(self->album);
+	free(self);
+}
+
+static void
+group_unref(struct cat_group *self)
+{
+	if (__atomic_sub_fetch(&self->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	for (int i = 0; i < self->len; i++)
+		song_unref(self->songs[i]);
+	resp_cache_clear(&self->cache);
+	free(self);
+}
+
+static void
+wgroup_free(struct wgroup *self)
+{
+	if (self->published)
+		group_unref(self->published);
+	g_ptr_array_free(self->songs, true);
+	free(self->name);
+	free(self);
+}
+
+// the ordering artist_query has always returned songs in.
+static int
+artist_song_cmp(const void *a, const void *b)
+{
+	const struct cat_song *sa = *(struct cat_song *const *)a;
+	const struct cat_song *sb = *(struct cat_song *const *)b;
+	int ret;
+
+	if ((ret = strcmp(sa->album, sb->album)))
+		return ret;
+	if (sa->track != sb->track)
+		return sa->track < sb->track ? -1 : 1;
+	if ((ret = strcmp(sa->title, sb->title)))
+		return ret;
+	return strcmp(sa->path, sb->path);
+}
+
+// the ordering album_query has always returned songs in.
+static int
+album_song_cmp(const void *a, const void *b)
+{
+	const struct cat_song *sa = *(struct cat_song *const *)a;
+	const struct cat_song *sb = *(struct cat_song *const *)b;
+	int ret;
+
+	if ((ret = strcmp(sa->album, sb->album)))
+		return ret;
+	if (sa->track != sb->track)
+		return sa->track < sb->track ? -1 : 1;
+	if ((ret = strcmp(sa->artist, sb->artist)))
+		return ret;
+	if ((ret = strcmp(sa->title, sb->title)))
+		return ret;
+	return strcmp(sa->path, sb->path);
+}
+
+static int
+group_name_cmp(const void *a, const void *b)
+{
+	const struct cat_group *ga = *(struct cat_group *const *)a;
+	const struct cat_group *gb = *(struct cat_group *const *)b;
+	return strcmp(ga->name, gb->name);
+}
+
+static int
+group_id_cmp(const void *a, const void *b)
+{
+	const struct cat_group *ga = *(struct cat_group *const *)a;
+	const struct cat_group *gb = *(struct cat_group *const *)b;
+	if (ga->id != gb->id)
+		return ga->id < gb->id ? -1 : 1;
+	return 0;
+}
+
+// builds the immutable, sorted version of a working group.  in 1
+// allocation get the group, its song array and its name.
+static struct cat_group *
+group_new(struct wgroup *wg, song_cmp cmp)
+{
+	struct cat_group *ret;
+	size_t len, name_len;
+	char *name;
+
+	len = wg->songs->len;
+	name_len = strlen(wg->name) + 1;
+	ret = xmalloc(sizeof(*ret) + len * sizeof(ret->songs[0]) + name_len);
+	name = (char *)&ret->songs[len];
+	memcpy(name, wg->name, name_len);
+
+	ret->refs = 1;
+	ret->id = wg->id;
+	ret->name = name;
+	ret->time = 0;
+	ret->generation = generation;
+	memset(&ret->cache, 0, sizeof(ret->cache));
+	ret->len = len;
+	for (size_t i = 0; i < len; i++) {
+		ret->songs[i] = wg->songs->pdata[i];
+		ret->time += ret->songs[i]->time;
+		__atomic_add_fetch(&ret->songs[i]->refs, 1, __ATOMIC_RELAXED);
+	}
+	qsort(ret->songs, len, sizeof(ret->songs[0]), cmp);
+
+	return ret;
+}
+
+static void
+group_add(GHashTable *groups, struct names *names, const char *name,
+	  int64_t id, struct cat_song *song)
+{
+	struct wgroup *wg;
+
+	wg = g_hash_table_lookup(groups, name);
+	if (!wg) {
+		wg = xcalloc(sizeof(*wg));
+		wg->name = strdup(name);
+		wg->songs = g_ptr_array_new();
+		g_hash_table_insert(groups, wg->name, wg);
+		if (name[0] != '\0')
+			names_add(names, name);
+	}
+	g_ptr_array_add(wg->songs, song);
+	wg->id = id;
+
+	if (wg->published) {
+		group_unref(wg->published);
+		wg->published = NULL;
+	}
+}
+
+static void
+group_del(GHashTable *groups, struct names *names, const char *name,
+	  struct cat_song *song)
+{
+	struct wgroup *wg;
+
+	wg = g_hash_table_lookup(groups, name);
+	if (unlikely(!wg)) {
+		log(ERROR, "%s: no group '%s'", __func__, name);
+		return;
+	}
+	g_ptr_array_remove_fast(wg->songs, song);
+
+	if (wg->published) {
+		group_unref(wg->published);
+		wg->published = NULL;
+	}
+	if (wg->songs->len == 0) {
+		if (name[0] != '\0')
+			names_remove(names, name);
+		// frees wg, along with the name it is keyed by
+		g_hash_table_remove(groups, name);
+	}
+}
+
+// returns a copy of groups (without references of their own),
+// sorted by id.
+static struct cat_group **
+groups_by_id(struct cat_group **groups, int len)
+{
+	struct cat_group **ret;
+
+	ret = xmalloc((len + 1) * sizeof(*ret));
+	memcpy(ret, groups, len * sizeof(*ret));
+	qsort(ret, len, sizeof(*ret), group_id_cmp);
+
+	return ret;
+}
+
+// returns true if both arrays hold groups with the same names.
+static bool
+same_names(struct cat_group **a, int alen, struct cat_group **b, int blen)
+{
+	if (alen != blen)
+		return false;
+	for (int i = 0; i < alen; i++) {
+		if (a[i] != b[i] && strcmp(a[i]->name, b[i]->name))
+			return false;
+	}
+	return true;
+}
+
+// returns a sorted array of references to the published version of
+// every group, building those that have changed since last time.
+static struct cat_group **
+groups_publish(GHashTable *groups, int *len, song_cmp cmp)
+{
+	GHashTableIter iter;
+	struct cat_group **ret;
+	struct wgroup *wg;
+	gpointer val;
+	int n;
+
+	ret = xmalloc((g_hash_table_size(groups) + 1) * sizeof(*ret));
+	n = 0;
+
+	g_hash_table_iter_init(&iter, groups);
+	while (g_hash_table_iter_next(&iter, NULL, &val)) {
+		wg = val;
+		// songs without a tag have always been left out of the
+		// artist and album lists.
+		if (wg->name[0] == '\0')
+			continue;
+		if (!wg->published)
+			wg->published = group_new(wg, cmp);
+		__atomic_add_fetch(&wg->published->refs, 1, __ATOMIC_RELAXED);
+		ret[n++] = wg->published;
+	}
+	qsort(ret, n, sizeof(*ret), group_name_cmp);
+
+	*len = n;
+	return ret;
+}
+
+void
+catalog_put(const char *path, const char *title, const char *artist,
+	    const char *album, int track, int time, int64_t artist_id,
+	    int64_t album_id)
+{
+	struct cat_song *song, *old;
+
+	song = xcalloc(sizeof(*song));
+	song->refs = 1;
+	song->track = track;
+	song->time = time;
+	song->path = strdup(path);
+	song->title = strdup(title);
+	song->artist = strdup(artist);
+	song->album = strdup(album);
+
+	old = g_hash_table_lookup(songs, path);
+	if (old) {
+		group_del(artists, artist_names, old->artist, old);
+		group_del(albums, album_names, old->album, old);
+	}
+	// drops the working copy's reference to old, if any
+	g_hash_table_replace(songs, song->path, song);
+
+	group_add(artists, artist_names, song->artist, artist_id, song);
+	group_add(albums, album_names, song->album, album_id, song);
+
+	pending++;
+	generation++;
+}
+
+void
+catalog_remove(const char *path)
+{
+	struct cat_song *old;
+
+	old = g_hash_table_lookup(songs, path);
+	if (!old)
+		return;
+
+	group_del(artists, artist_names, old->artist, old);
+	group_del(albums, album_names, old->album, old);
+	g_hash_table_remove(songs, path);
+
+	pending++;
+	generation++;
+}
+
+void
+catalog_publish(bool force)
+{
+	struct catalog *snap, *old;
+
+	if (!pending && current)
+		return;
+	if (!force && pending < PUBLISH_BATCH)
+		return;
+
+	snap = xcalloc(sizeof(*snap));
+	snap->refs = 1;
+	snap->generation = generation;
+	snap->artists = groups_publish(artists, &snap->nartists,
+				       artist_song_cmp);
+	snap->albums = groups_publish(albums, &snap->nalbums,
+				      album_song_cmp);
+	snap->artists_by_id = groups_by_id(snap->artists, snap->nartists);
+	snap->albums_by_id = groups_by_id(snap->albums, snap->nalbums);
+	snap->artist_names = names_publish(artist_names);
+	snap->album_names = names_publish(album_names);
+
+	// changes to songs don't change the lists of names unless an
+	// artist or album came or went, so keep those responses.
+	snap->artists_generation = generation;
+	if (current && same_names(snap->artists, snap->nartists,
+				  current->artists, current->nartists)) {
+		snap->artists_generation = current->artists_generation;
+		resp_cache_copy(&snap->artists_cache, &current->artists_cache);
+	}
+	snap->albums_generation = generation;
+	if (current && same_names(snap->albums, snap->nalbums,
+				  current->albums, current->nalbums)) {
+		snap->albums_generation = current->albums_generation;
+		resp_cache_copy(&snap->albums_cache, &current->albums_cache);
+	}
+
+	pthread_mutex_lock(&current_lock);
+	old = current;
+	current = snap;
+	__atomic_add_fetch(&published, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&current_lock);
+
+	if (old)
+		catalog_release(old);
+	pending = 0;
+}
+
+struct catalog *
+catalog_acquire(void)
+{
+	struct catalog *old;
+	uint64_t n;
+
+	n = __atomic_load_n(&published, __ATOMIC_ACQUIRE);
+	if (!cached || n != cached_published) {
+		old = cached;
+		pthread_mutex_lock(&current_lock);
+		cached = current;
+		cached_published = published;
+		__atomic_add_fetch(&cached->refs, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&current_lock);
+		if (old)
+			catalog_release(old);
+	}
+
+	__atomic_add_fetch(&cached->refs, 1, __ATOMIC_RELAXED);
+	return cached;
+}
+
+void
+catalog_ref(struct catalog *self)
+{
+	__atomic_add_fetch(&self->refs, 1, __ATOMIC_RELAXED);
+}
+
+void
+catalog_release(struct catalog *self)
+{
+	if (__atomic_sub_fetch(&self->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	for (int i = 0; i < self->nartists; i++)
+		group_unref(self->artists[i]);
+	for (int i = 0; i < self->nalbums; i++)
+		group_unref(self->albums[i]);
+	free(self->artists);
+	free(self->albums);
+	free(self->artists_by_id);
+	free(self->albums_by_id);
+	resp_cache_clear(&self->artists_cache);
+	resp_cache_clear(&self->albums_cache);
+	resp_cache_clear(&self->artist_ids_cache);
+	resp_cache_clear(&self->album_ids_cache);
+	name_index_unref(self->artist_names);
+	name_index_unref(self->album_names);
+	free(self);
+}
+
+struct cat_group *
+catalog_find(struct cat_group **groups, int len, const char *name)
+{
+	int lo, hi, mid, cmp;
+
+	lo = 0;
+	hi = len - 1;
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = strcmp(groups[mid]->name, name);
+		if (cmp == 0)
+			return groups[mid];
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return NULL;
+}
+
+struct cat_group *
+catalog_find_id(struct cat_group **groups, int len, int64_t id)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = len - 1;
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		if (groups[mid]->id == id)
+			return groups[mid];
+		if (groups[mid]->id < id)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return NULL;
+}
+
+int
+catalog_after(struct cat_group **groups, int len, const char *name)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = len;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(groups[mid]->name, name) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+void
+catalog_load(sqlite3 *db)
+{
+	uint64_t start;
+	int err;
+	sqlite3_stmt *stmt;
+
+	songs = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+				      (GDestroyNotify)song_unref);
+	artists = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+					(GDestroyNotify)wgroup_free);
+	albums = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+				       (GDestroyNotify)wgroup_free);
+	artist_names = names_new();
+	album_names = names_new();
+	generation = (uint64_t)time(NULL) << GENERATION_SHIFT;
+
+	PREPARE_QUERY(db, LOAD_QUERY, &stmt);
+
+	start = metrics_now();
+	while ((err = sqlite3_step(stmt)) == SQLITE_ROW) {
+		// we don't care about the unsigned qualifier
+		catalog_put((const char *)sqlite3_column_text(stmt, 0),
+			    (const char *)sqlite3_column_text(stmt, 1),
+			    (const char *)sqlite3_column_text(stmt, 2),
+			    (const char *)sqlite3_column_text(stmt, 3),
+			    sqlite3_column_int(stmt, 4),
+			    sqlite3_column_int(stmt, 5),
+			    sqlite3_column_int64(stmt, 6),
+			    sqlite3_column_int64(stmt, 7));
+	}
+	if (err != SQLITE_DONE)
+		exit_msg("%s: step: %d - %s", __func__, err,
+			 sqlite3_errmsg(db));
+	metrics_stmt(STMT_LOAD, start);
+
+	sqlite3_finalize(stmt);
+
+	catalog_publish(true);
+}
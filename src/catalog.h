@@ -0,0 +1,110 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#ifndef _CATALOG_H_
+#define _CATALOG_H_
+
+#include "common.h"
+#include "cache.h"
+#include "complete.h"
+
+// the in-memory copy of the music table.  The indexer thread is the
+// only writer: it updates a private working copy with catalog_put and
+// catalog_remove, and catalog_publish swaps in a new immutable
+// snapshot for readers.  Readers never wait on a write, and only take
+// a lock the first time they look after a new snapshot is published.
+
+struct cat_song {
+	int refs;
+	int track;
+	int time;
+	char *path;
+	char *title;
+	char *artist;
+	char *album;
+};
+
+// all the songs by an artist or on an album, sorted in the order
+// the API returns them.  immutable, and shared between snapshots
+// until a song in it changes.
+struct cat_group {
+	int refs;
+	// from the artists or albums table
+	int64_t id;
+	const char *name;
+	// the total length of the songs, in seconds
+	int64_t time;
+	// the catalog generation this version of the group was built at
+	uint64_t generation;
+	struct resp_cache cache;
+	int len;
+	struct cat_song *songs[];
+};
+
+struct catalog {
+	int refs;
+	// incremented for every insert, update and delete.  It starts
+	// from the time we were started (scaled), so that it keeps
+	// increasing across restarts.
+	uint64_t generation;
+	// both sorted by name
+	int nartists;
+	struct cat_group **artists;
+	int nalbums;
+	struct cat_group **albums;
+	// the same groups, sorted by id
+	struct cat_group **artists_by_id;
+	struct cat_group **albums_by_id;
+	// responses listing the artists and albums, and the generation
+	// they last changed at.  carried over to the next snapshot if
+	// the set of names doesn't change.
+	uint64_t artists_generation;
+	uint64_t albums_generation;
+	struct resp_cache artists_cache;
+	struct resp_cache albums_cache;
+	// responses listing the ids, names and sizes of the artists and
+	// albums.  Sizes change with any song, so these start empty in
+	// every snapshot.
+	struct resp_cache artist_ids_cache;
+	struct resp_cache album_ids_cache;
+	// the same names, case-folded for completion
+	struct name_index *artist_names;
+	struct name_index *album_names;
+};
+
+// populates the catalog from the music table and publishes the
+// first snapshot.  must be called before any other catalog function.
+void catalog_load(sqlite3 *db);
+
+// indexer-only: add or replace the song at path in the working copy.
+// The ids are those of its artist and album in the db.
+void catalog_put(const char *path, const char *title, const char *artist,
+		 const char *album, int track, int time, int64_t artist_id,
+		 int64_t album_id);
+// indexer-only: remove the song at path from the working copy.
+void catalog_remove(const char *path);
+// indexer-only: make changes visible to readers.  unless force is
+// true, changes are batched so that a crawl doesn't rebuild the
+// snapshot once per file.
+void catalog_publish(bool force);
+
+// returns a reference to the current snapshot, which stays valid
+// (and unchanged) until it is passed to catalog_release.  Each thread
+// keeps the last snapshot it was handed alive until it asks again
+// after a newer one is published.
+struct catalog *catalog_acquire(void);
+// takes another reference to a snapshot the caller already holds.
+void catalog_ref(struct catalog *self);
+void catalog_release(struct catalog *self);
+
+// binary search for name in one of a snapshot's group arrays.
+struct cat_group *catalog_find(struct cat_group **groups, int len,
+			       const char *name);
+// binary search for id in one of a snapshot's by_id arrays.
+struct cat_group *catalog_find_id(struct cat_group **groups, int len,
+				  int64_t id);
+// returns the index of the first group whose name sorts after name,
+// or len if there is none.
+int catalog_after(struct cat_group **groups, int len, const char *name);
+
+#endif // _CATALOG_H_
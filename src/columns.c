@@ -0,0 +1,191 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#include "columns.h"
+#include "common.h"
+#include "catalog.h"
+#include "format.h"
+#include "utils.h"
+
+#include <stdlib.h>
+
+#include <glib.h>
+
+enum COLUMN {
+	COL_ARTISTS,
+	COL_ALBUMS,
+	COL_TITLE,
+	COL_ARTIST,
+	COL_ALBUM,
+	COL_TRACK,
+	COL_TIME,
+	COL_PATH,
+	COL_MAX,
+};
+
+static const char *const COLUMN_NAMES[COL_MAX] = {
+	[COL_ARTISTS] = "artists",
+	[COL_ALBUMS] = "albums",
+	[COL_TITLE] = "title",
+	[COL_ARTIST] = "artist",
+	[COL_ALBUM] = "album",
+	[COL_TRACK] = "track",
+	[COL_TIME] = "time",
+	[COL_PATH] = "path",
+};
+
+static char *
+song_field(const struct cat_song *song, enum COLUMN col)
+{
+	return col == COL_ARTIST ? song->artist : song->album;
+}
+
+// fills idx with the index in dict of the artist or album (col) of
+// each song, adding values to dict as they are first seen.  returns
+// how many there are.  Songs come in runs with the same artist and
+// album, which don't need looking up.
+static int
+dict_encode(struct cat_song *const *songs, int len, enum COLUMN col,
+	    int *idx, const char **dict)
+{
+	GHashTable *seen;
+	char *prev, *s;
+	int n;
+
+	seen = g_hash_table_new(g_str_hash, g_str_equal);
+	prev = NULL;
+	n = 0;
+
+	for (int i = 0; i < len; i++) {
+		gpointer v;
+
+		s = song_field(songs[i], col);
+		if (prev && strcmp(s, prev) == 0) {
+			idx[i] = idx[i - 1];
+			continue;
+		}
+		prev = s;
+
+		// stored off by one, so that 0 isn't mistaken for missing
+		v = g_hash_table_lookup(seen, s);
+		if (!v) {
+			dict[n++] = s;
+			v = GINT_TO_POINTER(n);
+			g_hash_table_insert(seen, s, v);
+		}
+		idx[i] = GPOINTER_TO_INT(v) - 1;
+	}
+
+	g_hash_table_destroy(seen);
+	return n;
+}
+
+void
+columns_init(struct columns *self, const struct format_ops *fmt,
+	     struct cat_song *const *songs, int len)
+{
+	memset(self, 0, sizeof(*self));
+	self->fmt = fmt;
+	self->songs = songs;
+	self->len = len;
+
+	// one more, so there is something to allocate for no songs
+	self->artist = xmalloc(2 * (len + 1) * sizeof(*self->artist));
+	self->album = &self->artist[len + 1];
+	self->artists = xmalloc(2 * (len + 1) * sizeof(*self->artists));
+	self->albums = &self->artists[len + 1];
+
+	self->nartists = dict_encode(songs, len, COL_ARTIST, self->artist,
+				     self->artists);
+	self->nalbums = dict_encode(songs, len, COL_ALBUM, self->album,
+				    self->albums);
+}
+
+void
+columns_free(struct columns *self)
+{
+	free(self->artist);
+	free(self->artists);
+	self->artist = NULL;
+	self->artists = NULL;
+}
+
+static int
+column_len(struct columns *self, enum COLUMN col)
+{
+	switch (col) {
+	case COL_ARTISTS:
+		return self->nartists;
+	case COL_ALBUMS:
+		return self->nalbums;
+	default:
+		return self->len;
+	}
+}
+
+static void
+column_item(struct columns *self, struct wbuf *out, enum COLUMN col, int i)
+{
+	const struct format_ops *fmt = self->fmt;
+
+	switch (col) {
+	case COL_ARTISTS:
+		fmt->string(out, self->artists[i]);
+		break;
+	case COL_ALBUMS:
+		fmt->string(out, self->albums[i]);
+		break;
+	case COL_TITLE:
+		fmt->string(out, self->songs[i]->title);
+		break;
+	case COL_ARTIST:
+		fmt->integer(out, self->artist[i]);
+		break;
+	case COL_ALBUM:
+		fmt->integer(out, self->album[i]);
+		break;
+	case COL_TRACK:
+		fmt->integer(out, self->songs[i]->track);
+		break;
+	case COL_TIME:
+		fmt->integer(out, self->songs[i]->time);
+		break;
+	case COL_PATH:
+		fmt->string(out, self->songs[i]->path);
+		break;
+	case COL_MAX:
+		break;
+	}
+}
+
+bool
+columns_write(struct columns *self, struct wbuf *out, size_t min)
+{
+	const struct format_ops *fmt = self->fmt;
+	int n;
+
+	if (!self->started) {
+		fmt->map_start(out, COL_MAX);
+		self->started = true;
+	}
+
+	for (; self->col < COL_MAX; self->col++, self->next = 0) {
+		n = column_len(self, self->col);
+		if (!self->open) {
+			fmt->map_key(out, self->col, COLUMN_NAMES[self->col]);
+			self->mark = fmt->list_start(out, n);
+			self->open = true;
+		}
+		for (; self->next < n; self->next++) {
+			if (out->len >= min)
+				return true;
+			fmt->list_item(out, self->next);
+			column_item(self, out, self->col, self->next);
+		}
+		fmt->list_end(out, self->mark, n);
+		self->open = false;
+	}
+	fmt->map_end(out);
+
+	return false;
+}
@@ -0,0 +1,51 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#ifndef _COLUMNS_H_
+#define _COLUMNS_H_
+
+#include "common.h"
+
+// songs laid out a column at a time (?format=columnar), rather than
+// as a list of maps repeating every key.  The response is a map of
+// one list per field, where the artist and album of each song are
+// indexes into the lists of distinct "artists" and "albums":
+//
+//   {"artists":["Queen"],"albums":["Jazz"],
+//    "title":["Mustapha","Fat Bottomed Girls"],"artist":[0,0],
+//    "album":[0,0],"track":[1,2],"time":[183,256],"path":[...]}
+
+struct cat_song;
+struct format_ops;
+struct wbuf;
+
+struct columns {
+	const struct format_ops *fmt;
+	struct cat_song *const *songs;
+	int len;
+	// the artist and album of each song, as indexes into these
+	int *artist;
+	int *album;
+	const char **artists;
+	const char **albums;
+	int nartists;
+	int nalbums;
+	// where the next write picks up: the column, whether its list
+	// has been started (and what list_start said), and its next item.
+	bool started;
+	int col;
+	bool open;
+	size_t mark;
+	int next;
+};
+
+// lays out the len songs, which must outlive self.
+void columns_init(struct columns *self, const struct format_ops *fmt,
+		  struct cat_song *const *songs, int len);
+void columns_free(struct columns *self);
+
+// appends to out until it holds at least min bytes, or the response
+// is finished.  returns true if there is more to come.
+bool columns_write(struct columns *self, struct wbuf *out, size_t min);
+
+#endif // _COLUMNS_H_
@@ -31,18 +31,103 @@ extern const int BACKLOG;
 extern const char *program_name;
 extern int verbosity;
 
+struct arena;
 struct req;
+struct stmt_cache;
+struct response;
 struct evhttp_request;
 
+// content codings we can send a response body in
+enum RESP_ENCODING {
+	ENC_IDENTITY,
+	ENC_GZIP,
+	ENC_BROTLI,
+	ENC_MAX,
+};
+
+// formats we can write a response in (see format.h)
+enum RESP_KIND {
+	RESP_JSON,
+	RESP_MSGPACK,
+	RESP_MAX,
+};
+
+// how lists of songs are laid out: a map per song, or a list per
+// field (?format=columnar, see columns.h)
+enum RESP_LAYOUT {
+	LAYOUT_ROWS,
+	LAYOUT_COLUMNS,
+	LAYOUT_MAX,
+};
+
+// both return a new reference to the response body, or NULL if the
+// client's copy (named by If-None-Match) is still current, if they
+// have started streaming the response themselves (setting streamed),
+// or if the db couldn't answer (setting failed).
 struct ops {
-	char *(*list)(struct req *self);
-	char *(*query)(struct req *self, const char *name);
+	struct response *(*list)(struct req *self);
+	struct response *(*query)(struct req *self, const char *name);
+	// for artists and albums, which have ids ('/artist/id/...'): a
+	// list of their ids, names and sizes, and the songs of one of
+	// them by id.  NULL for the others.
+	struct response *(*list_ids)(struct req *self);
+	struct response *(*query_id)(struct req *self, int64_t id);
+};
+
+// the part of a result the client asked for with the offset, limit
+// and after query parameters.
+struct page {
+	// false if the client wants the whole result
+	bool paged;
+	int offset;
+	// -1 for no limit
+	int limit;
+	// start after this key (a name, or a song's path)
+	const char *after;
+};
+
+// the most phases of a request a trace keeps apart
+#define TRACE_PHASES (12)
+// how much of the uri a trace keeps, for the slow request log
+#define TRACE_URI_LEN (128)
+
+// how long each phase of handling a request took, see trace.h.
+struct trace {
+	// false if neither the client nor the slow request log wants it
+	bool on;
+	// the client asked for the breakdown in the response
+	bool wanted;
+	uint64_t start;
+	// when the last phase ended
+	uint64_t last;
+	int len;
+	struct {
+		const char *name;
+		uint64_t ns;
+	} phases[TRACE_PHASES];
+	char uri[TRACE_URI_LEN];
 };
 
+// a request, allocated from (and freed with) arena.
 struct req {
+	struct arena *arena;
 	struct ops *ops;
 	struct evhttp_request *req;
-	sqlite3 *db;
+	// the worker's statements, and its connection
+	struct stmt_cache *stmts;
+	// the best format and encoding the client accepts, and the
+	// layout it asked for
+	enum RESP_KIND kind;
+	enum RESP_LAYOUT layout;
+	enum RESP_ENCODING encoding;
+	bool streamed;
+	bool failed;
+	struct page page;
+	// what to look for, for a search
+	const char *terms;
+	// what has been typed so far, for a completion
+	const char *prefix;
+	struct trace trace;
 };
 
 #endif // _COMMON_H_
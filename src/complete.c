@@ -0,0 +1,210 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#include "common.h"
+#include "complete.h"
+#include "utils.h"
+
+#include <stdlib.h>
+
+#include <glib.h>
+
+// a name and its case-folded key.  immutable, and shared by the
+// working copy and every index it is in.  in 1 allocation get the
+// entry, its key and its name.
+struct name_entry {
+	int refs;
+	const char *name;
+	char key[];
+};
+
+struct name_index {
+	int refs;
+	int len;
+	// sorted by key, then name
+	struct name_entry *entries[];
+};
+
+struct names {
+	// the working copy, kept sorted as names are added and removed
+	GPtrArray *entries;
+	// the index for the working copy as of the last publish, or
+	// NULL if a name has come or gone since.
+	struct name_index *published;
+};
+
+static struct name_entry *
+entry_new(const char *name)
+{
+	struct name_entry *ret;
+	size_t key_len, name_len;
+	char *key;
+
+	key = g_utf8_casefold(name, -1);
+	key_len = strlen(key) + 1;
+	name_len = strlen(name) + 1;
+
+	ret = xmalloc(sizeof(*ret) + key_len + name_len);
+	ret->refs = 1;
+	memcpy(ret->key, key, key_len);
+	memcpy(&ret->key[key_len], name, name_len);
+	ret->name = &ret->key[key_len];
+
+	g_free(key);
+	return ret;
+}
+
+static void
+entry_unref(struct name_entry *self)
+{
+	if (__atomic_sub_fetch(&self->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	free(self);
+}
+
+static int
+entry_cmp(const struct name_entry *a, const char *key, const char *name)
+{
+	int ret;
+
+	if ((ret = strcmp(a->key, key)))
+		return ret;
+	return strcmp(a->name, name);
+}
+
+// returns the index of the first of the len entries that doesn't sort
+// before (key, name).  a NULL name sorts before any other.
+static int
+lower_bound(struct name_entry **entries, int len, const char *key,
+	    const char *name)
+{
+	int lo, hi, mid, cmp;
+
+	lo = 0;
+	hi = len;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (name)
+			cmp = entry_cmp(entries[mid], key, name);
+		else
+			cmp = strcmp(entries[mid]->key, key);
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+struct names *
+names_new(void)
+{
+	struct names *ret;
+
+	ret = xcalloc(sizeof(*ret));
+	ret->entries = g_ptr_array_new();
+
+	return ret;
+}
+
+void
+names_add(struct names *self, const char *name)
+{
+	struct name_entry *entry;
+	int i;
+
+	entry = entry_new(name);
+	i = lower_bound((struct name_entry **)self->entries->pdata,
+			self->entries->len, entry->key, name);
+	g_ptr_array_insert(self->entries, i, entry);
+
+	if (self->published) {
+		name_index_unref(self->published);
+		self->published = NULL;
+	}
+}
+
+void
+names_remove(struct names *self, const char *name)
+{
+	struct name_entry **entries;
+	char *key;
+	int i, len;
+
+	entries = (struct name_entry **)self->entries->pdata;
+	len = self->entries->len;
+
+	key = g_utf8_casefold(name, -1);
+	i = lower_bound(entries, len, key, name);
+	if (unlikely(i == len || entry_cmp(entries[i], key, name))) {
+		log(ERROR, "%s: no name '%s'", __func__, name);
+		g_free(key);
+		return;
+	}
+	g_free(key);
+
+	entry_unref(g_ptr_array_remove_index(self->entries, i));
+
+	if (self->published) {
+		name_index_unref(self->published);
+		self->published = NULL;
+	}
+}
+
+struct name_index *
+names_publish(struct names *self)
+{
+	struct name_index *index;
+	int len;
+
+	if (!self->published) {
+		len = self->entries->len;
+		index = xmalloc(sizeof(*index) + len * sizeof(index->entries[0]));
+		index->refs = 1;
+		index->len = len;
+		for (int i = 0; i < len; i++) {
+			index->entries[i] = self->entries->pdata[i];
+			__atomic_add_fetch(&index->entries[i]->refs, 1,
+					   __ATOMIC_RELAXED);
+		}
+		self->published = index;
+	}
+
+	__atomic_add_fetch(&self->published->refs, 1, __ATOMIC_RELAXED);
+	return self->published;
+}
+
+void
+name_index_unref(struct name_index *self)
+{
+	if (__atomic_sub_fetch(&self->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	for (int i = 0; i < self->len; i++)
+		entry_unref(self->entries[i]);
+	free(self);
+}
+
+int
+name_index_complete(struct name_index *self, const char *prefix,
+		    const char **out, int n)
+{
+	char *key;
+	size_t key_len;
+	int i, count;
+
+	key = g_utf8_casefold(prefix, -1);
+	key_len = strlen(key);
+
+	// every name starting with the prefix sorts together, starting
+	// with the first that doesn't sort before it.
+	count = 0;
+	i = lower_bound(self->entries, self->len, key, NULL);
+	for (; i < self->len && count < n; i++) {
+		if (strncmp(self->entries[i]->key, key, key_len))
+			break;
+		out[count++] = self->entries[i]->name;
+	}
+
+	g_free(key);
+	return count;
+}
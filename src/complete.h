@@ -0,0 +1,34 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#ifndef _COMPLETE_H_
+#define _COMPLETE_H_
+
+#include "common.h"
+
+// a case-folded index of names (of artists or albums), for
+// completing what someone has started to type.  The catalog keeps a
+// working copy of the names up to date as groups come and go, and
+// publishes an immutable, sorted name_index alongside each snapshot.
+
+struct names;
+struct name_index;
+
+struct names *names_new(void);
+// indexer-only: add name to, or remove it from, the working copy.
+void names_add(struct names *self, const char *name);
+void names_remove(struct names *self, const char *name);
+// indexer-only: returns a reference to an index of the names in the
+// working copy, which is shared with the last snapshot if no names
+// have come or gone since.
+struct name_index *names_publish(struct names *self);
+
+void name_index_unref(struct name_index *self);
+
+// fills out with up to n of the names starting with prefix, ignoring
+// case, in order.  returns how many there were.  The names live as
+// long as the index.
+int name_index_complete(struct name_index *self, const char *prefix,
+			const char **out, int n);
+
+#endif // _COMPLETE_H_
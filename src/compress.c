@@ -0,0 +1,325 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#include "common.h"
+#include "compress.h"
+#include "cache.h"
+#include "utils.h"
+
+#include <stdlib.h>
+
+#include <event2/buffer.h>
+#include <event2/http.h>
+
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+// below this, the headers cost more than compression saves
+#define MIN_COMPRESS_LEN (256)
+// bodies are compressed once per catalog change, not once per
+// request, so favor size over speed.
+#define GZIP_LEVEL (9)
+#define BROTLI_QUALITY (9)
+// streams are compressed once per request, so go easier on the CPU.
+#define STREAM_GZIP_LEVEL (6)
+#define STREAM_BROTLI_QUALITY (5)
+// output space to reserve per call into the compressor
+#define ZOUT_CHUNK (16 * 1024)
+
+struct zstream {
+	enum RESP_ENCODING encoding;
+	z_stream zs;
+#ifdef HAVE_BROTLI
+	BrotliEncoderState *br;
+#endif
+};
+
+// returns true if the accept-params in [params, end) give a quality
+// of 0, meaning 'not acceptable'.
+static bool
+q_is_zero(const char *params, const char *end)
+{
+	const char *q;
+
+	for (q = params; q < end; q++) {
+		if ((q[0] == 'q' || q[0] == 'Q') && q[1] == '=')
+			return strtod(&q[2], NULL) == 0;
+	}
+	return false;
+}
+
+enum RESP_ENCODING
+accept_encoding(struct evhttp_request *req)
+{
+	const char *header, *p;
+	// -1 if not mentioned, otherwise whether it is acceptable
+	int gzip, br, any;
+
+	header = evhttp_find_header(evhttp_request_get_input_headers(req),
+				    "Accept-Encoding");
+	if (!header)
+		return ENC_IDENTITY;
+
+	gzip = br = any = -1;
+	for (p = header; *p;) {
+		const char *end;
+		size_t len;
+		int ok;
+
+		p += strspn(p, " \t,");
+		if (!*p)
+			break;
+		len = strcspn(p, ";, \t");
+		end = p + strcspn(p, ",");
+		ok = !q_is_zero(&p[len], end);
+
+		if (len == 4 && !strncasecmp(p, "gzip", len))
+			gzip = ok;
+		else if (len == 6 && !strncasecmp(p, "x-gzip", len))
+			gzip = ok;
+		else if (len == 2 && !strncasecmp(p, "br", len))
+			br = ok;
+		else if (len == 1 && *p == '*')
+			any = ok;
+		p = end;
+	}
+
+	// '*' covers anything not listed explicitly
+	if (br == -1)
+		br = any;
+	if (gzip == -1)
+		gzip = any;
+
+#ifdef HAVE_BROTLI
+	if (br == 1)
+		return ENC_BROTLI;
+#endif
+	if (gzip == 1)
+		return ENC_GZIP;
+	return ENC_IDENTITY;
+}
+
+const char *
+encoding_name(enum RESP_ENCODING encoding)
+{
+	switch (encoding) {
+	case ENC_GZIP:
+		return "gzip";
+	case ENC_BROTLI:
+		return "br";
+	default:
+		return "identity";
+	}
+}
+
+static struct response *
+gzip_compress(const struct response *resp)
+{
+	z_stream zs;
+	uint8_t *out;
+	size_t len;
+	int err;
+
+	memset(&zs, 0, sizeof(zs));
+	// the +16 asks for a gzip header and trailer, rather than zlib's
+	err = deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 9,
+			   Z_DEFAULT_STRATEGY);
+	if (err != Z_OK) {
+		log(ERROR, "%s: deflateInit2: %d", __func__, err);
+		return NULL;
+	}
+
+	len = deflateBound(&zs, resp->len);
+	out = xmalloc(len);
+
+	zs.next_in = (uint8_t *)resp->data;
+	zs.avail_in = resp->len;
+	zs.next_out = out;
+	zs.avail_out = len;
+
+	err = deflate(&zs, Z_FINISH);
+	len = zs.total_out;
+	deflateEnd(&zs);
+
+	if (err != Z_STREAM_END) {
+		log(ERROR, "%s: deflate: %d", __func__, err);
+		free(out);
+		return NULL;
+	}
+
+	return response_new((char *)out, len, ENC_GZIP);
+}
+
+#ifdef HAVE_BROTLI
+static struct response *
+brotli_compress(const struct response *resp)
+{
+	uint8_t *out;
+	size_t len;
+
+	len = BrotliEncoderMaxCompressedSize(resp->len);
+	if (!len)
+		return NULL;
+	out = xmalloc(len);
+
+	if (!BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW,
+				   BROTLI_MODE_TEXT, resp->len,
+				   (const uint8_t *)resp->data, &len, out)) {
+		log(ERROR, "%s: BrotliEncoderCompress failed", __func__);
+		free(out);
+		return NULL;
+	}
+
+	return response_new((char *)out, len, ENC_BROTLI);
+}
+#endif
+
+struct response *
+response_compress(struct response *resp, enum RESP_ENCODING encoding)
+{
+	struct response *ret;
+
+	ret = NULL;
+	if (resp->len >= MIN_COMPRESS_LEN) {
+		if (encoding == ENC_GZIP)
+			ret = gzip_compress(resp);
+#ifdef HAVE_BROTLI
+		else if (encoding == ENC_BROTLI)
+			ret = brotli_compress(resp);
+#endif
+	}
+
+	if (ret && ret->len < resp->len)
+		return ret;
+
+	if (ret)
+		response_unref(ret);
+	response_ref(resp);
+	return resp;
+}
+
+struct zstream *
+zstream_new(enum RESP_ENCODING encoding)
+{
+	struct zstream *ret;
+	int err;
+
+	ret = xcalloc(sizeof(*ret));
+	ret->encoding = encoding;
+
+#ifdef HAVE_BROTLI
+	if (encoding == ENC_BROTLI) {
+		ret->br = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+		if (!ret->br)
+			exit_msg("%s: BrotliEncoderCreateInstance failed",
+				 __func__);
+		BrotliEncoderSetParameter(ret->br, BROTLI_PARAM_QUALITY,
+					  STREAM_BROTLI_QUALITY);
+		BrotliEncoderSetParameter(ret->br, BROTLI_PARAM_MODE,
+					  BROTLI_MODE_TEXT);
+		return ret;
+	}
+#endif
+	if (encoding != ENC_GZIP)
+		exit_msg("%s: unsupported encoding %d", __func__, encoding);
+
+	err = deflateInit2(&ret->zs, STREAM_GZIP_LEVEL, Z_DEFLATED, 15 + 16,
+			   9, Z_DEFAULT_STRATEGY);
+	if (err != Z_OK)
+		exit_msg("%s: deflateInit2: %d", __func__, err);
+
+	return ret;
+}
+
+static void
+gzip_write(struct zstream *self, const uint8_t *data, size_t len,
+	   bool finish, struct evbuffer *out)
+{
+	struct evbuffer_iovec vec;
+	z_stream *zs;
+	int err;
+
+	zs = &self->zs;
+	zs->next_in = (uint8_t *)(uintptr_t)data;
+	zs->avail_in = len;
+
+	// keep going until deflate doesn't fill the space we give it
+	do {
+		if (evbuffer_reserve_space(out, ZOUT_CHUNK, &vec, 1) < 1)
+			exit_msg("%s: evbuffer_reserve_space failed", __func__);
+		zs->next_out = vec.iov_base;
+		zs->avail_out = vec.iov_len;
+
+		err = deflate(zs, finish ? Z_FINISH : Z_SYNC_FLUSH);
+		if (err == Z_STREAM_ERROR)
+			exit_msg("%s: deflate: %d", __func__, err);
+
+		vec.iov_len -= zs->avail_out;
+		evbuffer_commit_space(out, &vec, 1);
+	} while (zs->avail_out == 0);
+}
+
+#ifdef HAVE_BROTLI
+static void
+brotli_write(struct zstream *self, const uint8_t *data, size_t len,
+	     bool finish, struct evbuffer *out)
+{
+	struct evbuffer_iovec vec;
+	BrotliEncoderOperation op;
+	size_t avail_out;
+	uint8_t *next_out;
+
+	op = finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_FLUSH;
+	do {
+		if (evbuffer_reserve_space(out, ZOUT_CHUNK, &vec, 1) < 1)
+			exit_msg("%s: evbuffer_reserve_space failed", __func__);
+		next_out = vec.iov_base;
+		avail_out = vec.iov_len;
+
+		if (!BrotliEncoderCompressStream(self->br, op, &len, &data,
+						 &avail_out, &next_out, NULL))
+			exit_msg("%s: BrotliEncoderCompressStream failed",
+				 __func__);
+
+		vec.iov_len -= avail_out;
+		evbuffer_commit_space(out, &vec, 1);
+	} while (len || BrotliEncoderHasMoreOutput(self->br) ||
+		 (finish && !BrotliEncoderIsFinished(self->br)));
+}
+#endif
+
+void
+zstream_write(struct zstream *self, struct evbuffer *in, bool finish,
+	      struct evbuffer *out)
+{
+	const uint8_t *data;
+	size_t len;
+
+	// both compressors want contiguous input, and in is at most a
+	// chunk's worth of rows.
+	len = evbuffer_get_length(in);
+	data = evbuffer_pullup(in, -1);
+
+#ifdef HAVE_BROTLI
+	if (self->encoding == ENC_BROTLI)
+		brotli_write(self, data, len, finish, out);
+	else
+#endif
+		gzip_write(self, data, len, finish, out);
+
+	evbuffer_drain(in, len);
+}
+
+void
+zstream_free(struct zstream *self)
+{
+#ifdef HAVE_BROTLI
+	if (self->br)
+		BrotliEncoderDestroyInstance(self->br);
+	else
+#endif
+		deflateEnd(&self->zs);
+	free(self);
+}
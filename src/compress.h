@@ -0,0 +1,36 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include "common.h"
+
+struct evbuffer;
+struct evhttp_request;
+struct response;
+struct zstream;
+
+// picks the best encoding req's Accept-Encoding allows, preferring
+// brotli (if we were built with it) over gzip over nothing.
+enum RESP_ENCODING accept_encoding(struct evhttp_request *req);
+// the Content-Encoding header value for encoding.
+const char *encoding_name(enum RESP_ENCODING encoding);
+
+// returns a new reference to resp compressed with encoding.  Small
+// bodies, and ones which don't get any smaller, come back as resp
+// itself, still in the identity encoding.
+struct response *response_compress(struct response *resp,
+				   enum RESP_ENCODING encoding);
+
+// incremental compression, for responses that are too big to build
+// (and cache) in one piece.
+struct zstream *zstream_new(enum RESP_ENCODING encoding);
+// compresses and drains everything in in onto out, flushed so that
+// the client can decode all of it.  If finish is set, the stream is
+// ended and nothing more may be written.
+void zstream_write(struct zstream *self, struct evbuffer *in, bool finish,
+		   struct evbuffer *out);
+void zstream_free(struct zstream *self);
+
+#endif // _COMPRESS_H_
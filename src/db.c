@@ -0,0 +1,339 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#include "common.h"
+#include "db.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <strings.h>
+
+int64_t db_mmap_size = 256 * 1024 * 1024;
+int db_cache_kib = 8192;
+// in WAL mode, NORMAL only syncs at checkpoints: a power cut can lose
+// the last few changes, but never corrupts the db.
+const char *db_synchronous = "normal";
+
+static const char *const SYNCHRONOUS_MODES[] =
+{
+	"off",
+	"normal",
+	"full",
+	"extra",
+	NULL
+};
+
+// the schema as it first was; MIGRATIONS bring it up to date.
+static const char *const INITIAL_STMTS[] =
+{
+	"CREATE TABLE IF NOT EXISTS music ("
+	"       path     varchar(512) PRIMARY KEY NOT NULL,"
+	"       title    varchar(256) NOT NULL,"
+	"       artist   varchar(256) NOT NULL,"
+	"       album    varchar(256) NOT NULL,"
+	"       track    int,"
+	"       time     int,"
+	"       modified int64"
+	")",
+	"CREATE INDEX IF NOT EXISTS i_album ON music(album)",
+	"CREATE INDEX IF NOT EXISTS i_artist ON music(artist)",
+	"CREATE INDEX IF NOT EXISTS i_full ON music(artist, album, title, track, path)",
+	NULL
+};
+
+// artists and albums have ids, and keep the number and total length
+// of their songs, which tags.c keeps up to date as songs change.
+// These fill them in from scratch, from the music table.
+#define GROUPS_REBUILD(table, col, id)					\
+	"DELETE FROM " table,						\
+	"INSERT INTO " table " (name, tracks, time)"			\
+	"    SELECT " col ", count(*), ifnull(sum(time), 0)"		\
+	"    FROM music GROUP BY " col " ORDER BY " col,		\
+	"UPDATE music SET " id " ="					\
+	"    (SELECT id FROM " table " WHERE name = music." col ")"
+
+static const char *const GROUPS_REBUILD_STMTS[] =
+{
+	GROUPS_REBUILD("artists", "artist", "artist_id"),
+	GROUPS_REBUILD("albums", "album", "album_id"),
+	NULL
+};
+
+// the changes to the schema since INITIAL_STMTS, in order.  A db's
+// PRAGMA user_version is how many of them it has had.
+static const char *const MIGRATION_GROUPS[] =
+{
+	"CREATE TABLE artists ("
+	"       id       integer PRIMARY KEY,"
+	"       name     varchar(256) UNIQUE NOT NULL,"
+	"       tracks   int NOT NULL,"
+	"       time     int NOT NULL"
+	")",
+	"CREATE TABLE albums ("
+	"       id       integer PRIMARY KEY,"
+	"       name     varchar(256) UNIQUE NOT NULL,"
+	"       tracks   int NOT NULL,"
+	"       time     int NOT NULL"
+	")",
+	"ALTER TABLE music ADD COLUMN artist_id integer REFERENCES artists(id)",
+	"ALTER TABLE music ADD COLUMN album_id integer REFERENCES albums(id)",
+	GROUPS_REBUILD("artists", "artist", "artist_id"),
+	GROUPS_REBUILD("albums", "album", "album_id"),
+	"CREATE INDEX i_artist_id ON music(artist_id)",
+	"CREATE INDEX i_album_id ON music(album_id)",
+	NULL
+};
+
+// when each directory in the music dir last changed, as of the last
+// crawl, so that the next one can skip the files in it if it hasn't
+// since.  Times are in nanoseconds.
+static const char *const MIGRATION_DIRS[] =
+{
+	"CREATE TABLE dirs ("
+	"       path     varchar(512) PRIMARY KEY NOT NULL,"
+	"       mtime    int NOT NULL,"
+	"       ctime    int NOT NULL"
+	")",
+	NULL
+};
+
+// songs get an integer id of their own, which the full-text index
+// is keyed on.  The rowid of a table with any other primary key can
+// change under a VACUUM, leaving the index pointing at the wrong
+// songs.  sqlite can't change a table's primary key, so music is
+// copied into a new table.  Any index tags.c made before this is
+// dropped, and the triggers keep the new one in step with music from
+// now on.
+static const char *const MIGRATION_SONG_IDS[] =
+{
+	"DROP TABLE IF EXISTS music_fts",
+	"CREATE TABLE music_new ("
+	"       id       integer PRIMARY KEY,"
+	"       path     varchar(512) UNIQUE NOT NULL,"
+	"       title    varchar(256) NOT NULL,"
+	"       artist   varchar(256) NOT NULL,"
+	"       album    varchar(256) NOT NULL,"
+	"       track    int,"
+	"       time     int,"
+	"       modified int64,"
+	"       artist_id integer REFERENCES artists(id),"
+	"       album_id integer REFERENCES albums(id)"
+	")",
+	"INSERT INTO music_new (path, title, artist, album, track, time,"
+	"                       modified, artist_id, album_id)"
+	"    SELECT path, title, artist, album, track, time, modified,"
+	"           artist_id, album_id"
+	"    FROM music ORDER BY path",
+	"DROP TABLE music",
+	"ALTER TABLE music_new RENAME TO music",
+	"CREATE INDEX i_album ON music(album)",
+	"CREATE INDEX i_artist ON music(artist)",
+	"CREATE INDEX i_full ON music(artist, album, title, track, path)",
+	"CREATE INDEX i_artist_id ON music(artist_id)",
+	"CREATE INDEX i_album_id ON music(album_id)",
+	// the index only stores itself: its rows are read out of music.
+	"CREATE VIRTUAL TABLE music_fts USING fts5("
+	"       title, artist, album,"
+	"       content='music', content_rowid='id',"
+	"       tokenize='unicode61 remove_diacritics 2',"
+	"       prefix='2 3'"
+	")",
+	"CREATE TRIGGER music_fts_insert AFTER INSERT ON music BEGIN"
+	"    INSERT INTO music_fts (rowid, title, artist, album)"
+	"        VALUES (new.id, new.title, new.artist, new.album);"
+	"END",
+	"CREATE TRIGGER music_fts_delete AFTER DELETE ON music BEGIN"
+	"    INSERT INTO music_fts (music_fts, rowid, title, artist, album)"
+	"        VALUES ('delete', old.id, old.title, old.artist, old.album);"
+	"END",
+	"CREATE TRIGGER music_fts_update"
+	"    AFTER UPDATE OF title, artist, album ON music BEGIN"
+	"    INSERT INTO music_fts (music_fts, rowid, title, artist, album)"
+	"        VALUES ('delete', old.id, old.title, old.artist, old.album);"
+	"    INSERT INTO music_fts (rowid, title, artist, album)"
+	"        VALUES (new.id, new.title, new.artist, new.album);"
+	"END",
+	// index whatever is already in the music table
+	"INSERT INTO music_fts (music_fts) VALUES ('rebuild')",
+	NULL
+};
+
+static const char *const *const MIGRATIONS[] =
+{
+	MIGRATION_GROUPS,
+	MIGRATION_DIRS,
+	MIGRATION_SONG_IDS,
+};
+#define NMIGRATIONS (int)(sizeof(MIGRATIONS)/sizeof(MIGRATIONS[0]))
+
+void
+db_exec(sqlite3 *db, const char *stmt)
+{
+	char *err_msg;
+	int err;
+
+	err = sqlite3_exec(db, stmt, NULL, NULL, &err_msg);
+	if (err != SQLITE_OK)
+		exit_msg("sqlite3 '%s' error: %d (%s)", stmt, err, err_msg);
+}
+
+static void
+exec_all(sqlite3 *db, const char *const *stmts)
+{
+	for (const char *const *stmt = stmts; *stmt; stmt++)
+		db_exec(db, *stmt);
+}
+
+static int
+user_version(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	int err, ret;
+
+	PREPARE_QUERY(db, "PRAGMA user_version", &stmt);
+	ret = 0;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		ret = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	return ret;
+}
+
+bool
+db_set_synchronous(const char *mode)
+{
+	for (const char *const *m = SYNCHRONOUS_MODES; *m; m++) {
+		if (!strcasecmp(mode, *m)) {
+			db_synchronous = *m;
+			return true;
+		}
+	}
+	return false;
+}
+
+// applies the tuning every connection gets, writer or reader.
+static void
+db_tune(sqlite3 *db)
+{
+	char pragma[64];
+
+	snprintf(pragma, sizeof(pragma), "PRAGMA mmap_size = %lld",
+		 (long long)db_mmap_size);
+	db_exec(db, pragma);
+	// negative sizes are in KiB, rather than pages
+	snprintf(pragma, sizeof(pragma), "PRAGMA cache_size = -%d",
+		 db_cache_kib);
+	db_exec(db, pragma);
+}
+
+sqlite3 *
+db_open_writer(const char *path)
+{
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	char pragma[64];
+	int err;
+
+	err = sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE |
+			      SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL);
+	if (err != SQLITE_OK)
+		exit_msg("%s: couldn't open db: %d", __func__, err);
+
+	// the journal mode is kept in the db file, so this only does
+	// anything the first time.
+	PREPARE_QUERY(db, "PRAGMA journal_mode = WAL", &stmt);
+	if (sqlite3_step(stmt) != SQLITE_ROW ||
+	    strcasecmp((const char *)sqlite3_column_text(stmt, 0), "wal"))
+		log(WARN, "%s: couldn't switch db to WAL", __func__);
+	sqlite3_finalize(stmt);
+
+	snprintf(pragma, sizeof(pragma), "PRAGMA synchronous = %s",
+		 db_synchronous);
+	db_exec(db, pragma);
+	db_tune(db);
+
+	return db;
+}
+
+sqlite3 *
+db_open_reader(const char *path)
+{
+	sqlite3 *db;
+	int err;
+
+	err = sqlite3_open_v2(path, &db,
+			      SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL);
+	if (err != SQLITE_OK)
+		exit_msg("%s: couldn't open db read-only: %d", __func__, err);
+	db_tune(db);
+
+	return db;
+}
+
+void
+db_create(sqlite3 *db)
+{
+	char version[48];
+	int v;
+
+	exec_all(db, INITIAL_STMTS);
+
+	// each migration is applied whole, or not at all.
+	for (v = user_version(db); v < NMIGRATIONS; v++) {
+		log(INFO, "migrating db to version %d", v + 1);
+		db_exec(db, "BEGIN");
+		exec_all(db, MIGRATIONS[v]);
+		snprintf(version, sizeof(version), "PRAGMA user_version = %d",
+			 v + 1);
+		db_exec(db, version);
+		db_exec(db, "COMMIT");
+	}
+}
+
+void
+db_rebuild_groups(sqlite3 *db)
+{
+	exec_all(db, GROUPS_REBUILD_STMTS);
+}
+
+void
+stmt_cache_init(struct stmt_cache *self, sqlite3 *db)
+{
+	memset(self, 0, sizeof(*self));
+	self->db = db;
+}
+
+void
+stmt_cache_clear(struct stmt_cache *self)
+{
+	for (int i = 0; i < QUERY_MAX; i++) {
+		sqlite3_finalize(self->stmts[i]);
+		self->stmts[i] = NULL;
+	}
+}
+
+sqlite3_stmt *
+stmt_cache_get(struct stmt_cache *self, enum QUERY query, const char *sql)
+{
+	int err;
+
+	if (likely(self->stmts[query]))
+		return self->stmts[query];
+
+	// persistent, as it will be run for as long as we are up.
+	err = sqlite3_prepare_v3(self->db, sql, -1, SQLITE_PREPARE_PERSISTENT,
+				 &self->stmts[query], NULL);
+	if (err != SQLITE_OK) {
+		logf(ERROR, "prepare: %s", sqlite3_errmsg(self->db));
+		self->stmts[query] = NULL;
+	}
+
+	return self->stmts[query];
+}
+
+void
+stmt_cache_put(sqlite3_stmt *stmt)
+{
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
@@ -1,6 +1,12 @@
 // Copyright 2012 Bobby Powers. All rights reserved.
 // Use of this source code is governed by the MIT
 // license that can be found in the LICENSE file.
+#ifndef _DB_H_
+#define _DB_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
 #include <sqlite3.h>
 
 // FIXME: this is gross
@@ -13,3 +19,61 @@
 		if (err != SQLITE_OK)					\
 			exit_msg("sqlite3 prepare '%s' error: %d", in, err); \
 	} while (false)
+
+// how connections are tuned when they are opened, from the command
+// line: bytes of the db to read through mmap (0 for none), KiB of page
+// cache per connection, and the writer's PRAGMA synchronous.
+extern int64_t db_mmap_size;
+extern int db_cache_kib;
+extern const char *db_synchronous;
+
+// sets db_synchronous, returning false if mode isn't one sqlite knows.
+bool db_set_synchronous(const char *mode);
+
+// opens the db at path for the indexer, which is its only writer, and
+// switches it to WAL so readers and the writer don't block each other.
+sqlite3 *db_open_writer(const char *path);
+// opens a read-only connection for a worker.  Neither kind of
+// connection is serialized by sqlite, so each must only be used from
+// one thread at a time.
+sqlite3 *db_open_reader(const char *path);
+
+// runs stmt, exiting if it fails.
+void db_exec(sqlite3 *db, const char *stmt);
+
+// creates the music table and its indexes, if they don't exist yet,
+// and brings the schema of an older db up to date.
+void db_create(sqlite3 *db);
+// refills the artists and albums tables, and the ids in music, from
+// the songs in music.  For writers that bypass tags.c.
+void db_rebuild_groups(sqlite3 *db);
+
+// the statements requests run
+enum QUERY {
+	QUERY_SEARCH,
+	QUERY_PATH,
+	QUERY_MAX,
+};
+
+// a connection's statements, each prepared the first time it is
+// used and then kept, so requests don't compile SQL.  Each worker
+// has one for its own connection, so it is never shared between
+// threads.
+struct stmt_cache {
+	sqlite3 *db;
+	sqlite3_stmt *stmts[QUERY_MAX];
+};
+
+void stmt_cache_init(struct stmt_cache *self, sqlite3 *db);
+// finalizes every statement, so the connection can be closed.
+void stmt_cache_clear(struct stmt_cache *self);
+
+// returns the statement for query, preparing it from sql if this is
+// its first use, or NULL (having logged why) if it can't be.  It must
+// be given back with stmt_cache_put before it is asked for again.
+sqlite3_stmt *stmt_cache_get(struct stmt_cache *self, enum QUERY query,
+			     const char *sql);
+// resets stmt and clears its bindings, ready for its next use.
+void stmt_cache_put(sqlite3_stmt *stmt);
+
+#endif // _DB_H_
@@ -4,6 +4,7 @@
 #include "common.h"
 #include "utils.h"
 #include "dirwatch.h"
+#include "metrics.h"
 
 #include <stddef.h>
 #include <stdio.h>
@@ -13,7 +14,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
-#include <ftw.h>
+#include <dirent.h>
+#include <errno.h>
 
 #include <sys/inotify.h>
 #include <limits.h>
@@ -25,25 +27,17 @@
 #include <time.h>
 #include <sys/stat.h>
 
-#include <alloca.h>
+#include <glib.h>
 
 
 #define IBUF_LEN (10 * (sizeof(struct inotify_event) + NAME_MAX + 1))
-// the amount of buffer watch descriptors to allocate
-#define WD_EXTRA (512)
+// how many watch descriptors to make room for to start with
+#define WD_INITIAL (512)
 
 // don't need IN_DELETE_SELF because we get IN_IGNORED for free
 #define IN_MASK	\
 	(IN_CLOSE_WRITE | IN_CREATE | IN_MOVE | IN_DELETE)
 
-// TODO: these should be thread local via pthread keys
-// nasty globals to get around nftw limitations
-static int GLOBAL_ifd;
-static int GLOBAL_flags;
-static struct watch_list *GLOBAL_wds;
-static int GLOBAL_count;
-static struct dirwatch *GLOBAL_self;
-
 
 //static struct watch_list *watch_list_new(void);
 static int watch_list_init(struct watch_list *self, int len);
@@ -82,70 +76,116 @@ dirwatch_free(struct dirwatch *self)
 	free(self);
 }
 
-// callback for use with nftw
-static int
-add_watch(const char *fpath, const struct stat *sb __unused,
-	  int typeflag, struct FTW *ftwbuf __unused)
-{
-	int watch;
-
-	// only add watches to directories
-	if (!(typeflag & FTW_D))
-		return 0;
-
-	watch = inotify_add_watch(GLOBAL_ifd, fpath, GLOBAL_flags);
-	if (watch == -1)
-		exit_perr("inotify error");
+// a directory the crawl has been into, so that symlinks can't send it
+// round in circles.
+struct dir_id {
+	dev_t dev;
+	ino_t ino;
+};
 
-	watch_list_put(GLOBAL_wds, watch, strdup(fpath));
+static guint
+dir_id_hash(const void *key)
+{
+	const struct dir_id *id = key;
+	return (guint)(id->ino ^ id->dev);
+}
 
-	return 0;
+static gboolean
+dir_id_equal(const void *a, const void *b)
+{
+	const struct dir_id *x = a, *y = b;
+	return x->dev == y->dev && x->ino == y->ino;
 }
 
-// callback for use with nftw
-static int
-count_dirs(const char *fpath __unused, const struct stat *sb __unused,
-	   int typeflag, struct FTW *ftwbuf __unused)
+// crawl_file hands a file found by the first crawl to the callbacks,
+// as if inotify had told us about it.
+static void
+crawl_file(struct dirwatch *self, const char *path, const char *dir,
+	   const char *file)
 {
-	if ((typeflag & FTW_D))
-		++GLOBAL_count;
-	return 0;
+	if (self->is_valid && !self->is_valid(self, path, dir, file))
+		return;
+	if (self->is_modified(self, path, dir, file))
+		self->on_change(self, path, dir, file);
 }
 
-// callback for use with nftw
-static int
-on_startup(const char *fpath , const struct stat *sb __unused,
-	   int typeflag, struct FTW *ftwbuf __unused)
+// crawl watches the directory at path (len bytes long, in a buffer
+// of PATH_MAX), and then everything under it.  Files are only looked
+// at if is_dir_modified says their directory has changed, and entries
+// are told apart by the type readdir gives them, so that an unchanged
+// directory costs a read of the directory itself rather than a stat
+// of everything in it.
+static void
+crawl(struct dirwatch *self, GHashTable *seen, char *path, size_t len)
 {
-	struct dirwatch *self;
-	const char *file;
+	struct dirent *ent;
+	struct dir_id *id;
+	struct stat st;
 	char *dir;
-	size_t len;
-
-	if (typeflag & FTW_D)
-		return 0;
-
-	self = GLOBAL_self;
-
-	// can't fail on 'NIX because every full path should start with a '/'
-	file = strrchr(fpath, '/') + 1;
-	len = file - fpath;
-	// alloca can't fail (but can cause stack overflow...)
-	dir = alloca(len);
-	memcpy(dir, fpath, len-1);
-	// add a terminating null to the alloca'd string.
-	dir[len - 1] = '\0';
+	bool check_files;
+	size_t n;
+	DIR *d;
+	int watch, type;
+
+	d = opendir(path);
+	if (!d) {
+		log(WARN, "%s: opendir '%s': %s", __func__, path,
+		    strerror(errno));
+		return;
+	}
+	if (fstat(dirfd(d), &st))
+		exit_perr("%s: fstat '%s'", __func__, path);
+
+	id = xmalloc(sizeof(*id));
+	id->dev = st.st_dev;
+	id->ino = st.st_ino;
+	if (g_hash_table_contains(seen, id)) {
+		free(id);
+		closedir(d);
+		return;
+	}
+	g_hash_table_add(seen, id);
 
-	// and since we've filtered out events by now that happen to
-	// watch descriptors, we're sure that file isn't null (since
-	// the struct inotify_event only has a 0 length name field when
-	// the event refers to the watch descriptor itself).
-	if (self->is_valid && !self->is_valid(self, fpath, dir, file))
-		return 0;
+	// watch it before reading it, so that nothing changed from
+	// here on is missed.  The watch list owns dir.
+	dir = strdup(path);
+	watch = inotify_add_watch(self->ifd, dir, self->iflags);
+	if (watch == -1)
+		exit_perr("inotify error");
+	watch_list_put(&self->wds, watch, dir);
+
+	check_files = !self->is_dir_modified ||
+		self->is_dir_modified(self, dir, &st);
+
+	while ((ent = readdir(d))) {
+		if (ent->d_name[0] == '.' && (!ent->d_name[1] ||
+		    (ent->d_name[1] == '.' && !ent->d_name[2])))
+			continue;
+		n = strlen(ent->d_name);
+		if (len + 1 + n >= PATH_MAX)
+			continue;
+		path[len] = '/';
+		memcpy(&path[len + 1], ent->d_name, n + 1);
+
+		// symlinks are followed, and some filesystems don't
+		// fill the type in at all.
+		type = ent->d_type;
+		if (type == DT_LNK || type == DT_UNKNOWN) {
+			if (stat(path, &st))
+				type = DT_UNKNOWN;
+			else if (S_ISDIR(st.st_mode))
+				type = DT_DIR;
+			else if (S_ISREG(st.st_mode))
+				type = DT_REG;
+		}
 
-	if (self->is_modified(self, fpath, dir, file))
-		self->on_change(self, fpath, dir, file);
-	return 0;
+		if (type == DT_DIR)
+			crawl(self, seen, path, len + 1 + n);
+		else if (type == DT_REG && check_files)
+			crawl_file(self, path, dir, &path[len + 1]);
+	}
+	path[len] = '\0';
+	closedir(d);
 }
 
 static void
@@ -221,9 +261,9 @@ cleanup:
 static void *
 watch_routine(struct dirwatch *self)
 {
-	char buf[IBUF_LEN];
+	char buf[IBUF_LEN], path[PATH_MAX];
+	GHashTable *seen;
 	ssize_t len;
-	int count;
 
 	if (!self)
 		exit_msg("update_routine called with null self");
@@ -234,33 +274,26 @@ watch_routine(struct dirwatch *self)
 	if (self->ifd == -1)
 		exit_perr("inotify_init");
 
-	// find out how many directories we have
-	GLOBAL_count = 0;
-	nftw(self->dir_name, count_dirs, 32, 0);
-	count = GLOBAL_count;
-	printf("%d dirs\n", GLOBAL_count);
-
-	// initialize the mapping of watch descriptors -> dir names
-	// TODO: don't require WD_EXTRA, it should manage that auto-
-	// magically, dynamically adding more space if needed
-	watch_list_init(&self->wds, count + WD_EXTRA);
-
-	// add a watch to every directory
-	GLOBAL_ifd = self->ifd;
-	GLOBAL_flags = self->iflags;
-	GLOBAL_wds = &self->wds;
-	nftw(self->dir_name, add_watch, 32, 0);
-	GLOBAL_ifd = -1;
-	GLOBAL_flags = 0;
-	GLOBAL_wds = NULL;
+	watch_list_init(&self->wds, WD_INITIAL);
+
+	// watch every directory, and look for files that have changed
+	// since we last ran.
+	seen = g_hash_table_new_full(dir_id_hash, dir_id_equal, free, NULL);
+	len = strlen(self->dir_name);
+	if (len >= PATH_MAX)
+		exit_msg("%s: dir name too long", __func__);
+	memcpy(path, self->dir_name, len + 1);
+	crawl(self, seen, path, len);
+	g_hash_table_destroy(seen);
+	printf("%d dirs\n", self->wds.count);
 
 	// XXX: for debugging mostly.
 	fflush(stdout);
 
-	// TODO: nftw on every file
-	GLOBAL_self = self;
-	nftw(self->dir_name, on_startup, 32, 0);
-	GLOBAL_self = NULL;
+	if (self->on_crawled)
+		self->on_crawled(self);
+	if (self->on_idle)
+		self->on_idle(self);
 
 	// check for changes forever
 	while (true) {
@@ -274,9 +307,13 @@ watch_routine(struct dirwatch *self)
 		for (char *p = buf; p < buf + len;) {
 			struct inotify_event *event;
 			event = (struct inotify_event *)p;
+			metrics_indexer(IDX_EVENTS);
 			handle_ievent(self, event);
 			p += sizeof(*event) + event->len;
 		}
+
+		if (self->on_idle)
+			self->on_idle(self);
 	}
 
 	dirwatch_free(self);
@@ -318,7 +355,7 @@ watch_list_free(struct watch_list *self)
 static char *
 watch_list_get(struct watch_list *self, int wd)
 {
-	if (wd < 0 || wd > self->len)
+	if (wd < 0 || wd >= self->len)
 		exit_msg("invalid wd: %d (len: %u)", wd, self->len);
 
 	return self->slab[wd];
@@ -327,9 +364,33 @@ watch_list_get(struct watch_list *self, int wd)
 static int
 watch_list_put(struct watch_list *self, int wd, char *path)
 {
+	int len;
+
+	if (wd < 0)
+		exit_msg("invalid wd: %d", wd);
+
+	// watch descriptors are handed out in order, so the slab is
+	// grown to fit rather than sized for every directory up front.
+	if (wd >= self->len) {
+		for (len = self->len; len <= wd; len *= 2)
+			;
+		self->slab = realloc(self->slab, len * sizeof(char *));
+		if (!self->slab)
+			exit_perr("%s: realloc", __func__);
+		memset(&self->slab[self->len], 0,
+		       (len - self->len) * sizeof(char *));
+		self->len = len;
+	}
+
+	if (!self->slab[wd] && path)
+		self->count++;
+	else if (self->slab[wd] && !path)
+		self->count--;
+
 	if (self->slab[wd])
 		free(self->slab[wd]);
 	self->slab[wd] = path;
+	metrics_watches(self->count);
 	return 0;
 }
 
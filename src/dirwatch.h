@@ -8,16 +8,25 @@
 #include <pthread.h>
 
 struct inotify_event;
+struct stat;
 struct watch_list;
 
 // basically for internal use
 struct watch_list {
 	char **slab;
 	int len;
+	// the number of slots in use
+	int count;
 };
 
 // is_valid may be null, in which case no filtering of the events will
-// be performed
+// be performed.  on_idle may be null too; otherwise it is called once
+// the initial crawl is done and after each batch of inotify events.
+// on_crawled (which may also be null) is called just once, when the
+// initial crawl is done, before on_idle.  is_dir_modified may be null
+// as well; otherwise the initial crawl asks it about each directory,
+// with its stat, and skips the files in it (but not its
+// subdirectories) if it returns false.
 struct dirwatch {
 	bool (*is_valid)(struct dirwatch *self,
 			 const char *path,
@@ -27,6 +36,9 @@ struct dirwatch {
 			    const char *path,
 			    const char *dir,
 			    const char *file);
+	bool (*is_dir_modified)(struct dirwatch *self,
+				const char *path,
+				const struct stat *st);
 // don't have on_new yet, probably will require recording a list of
 // IN_CREATE'ed files, and checking that list when files are
 // IN_CLOSE_WRITE'ed
@@ -42,6 +54,8 @@ struct dirwatch {
 			  const char *path,
 			  const char *dir,
 			  const char *file);
+	void (*on_crawled)(struct dirwatch *self);
+	void (*on_idle)(struct dirwatch *self);
 	void (*cleanup)(struct dirwatch *self);
 	const char *dir_name;
 	struct watch_list wds;
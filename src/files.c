@@ -0,0 +1,328 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#include "common.h"
+#include "db.h"
+#include "files.h"
+#include "metrics.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <event2/http_struct.h>
+
+#define HTTP_PARTIAL 206
+#define HTTP_RANGE_NOT_SATISFIABLE 416
+
+// big enough for an HTTP date, like 'Sun, 06 Nov 1994 08:49:37 GMT'
+#define HTTP_DATE_LEN 32
+
+static const char *const HTTP_DATE_FMT = "%a, %d %b %Y %H:%M:%S GMT";
+
+static const char *const PATH_QUERY =
+	"SELECT 1 FROM music WHERE path = ?";
+
+static const struct {
+	const char *ext;
+	const char *type;
+} MIME_TYPES[] = {
+	{"mp3", "audio/mpeg"},
+	{"ogg", "audio/ogg"},
+	{"oga", "audio/ogg"},
+	{"opus", "audio/ogg"},
+	{"m4a", "audio/mp4"},
+	{"aac", "audio/aac"},
+	{"flac", "audio/flac"},
+	{"wav", "audio/wav"},
+	{NULL, NULL},
+};
+
+enum RANGE {
+	// no (usable) Range header: send the whole file
+	RANGE_NONE,
+	RANGE_OK,
+	// a valid range that starts past the end of the file
+	RANGE_BAD,
+};
+
+static const char *music_dir;
+
+void
+files_init(const char *dir)
+{
+	music_dir = dir;
+}
+
+static const char *
+mime_type(const char *path)
+{
+	const char *ext;
+
+	ext = strrchr(path, '.');
+	if (!ext || strchr(ext, '/'))
+		return "application/octet-stream";
+
+	for (int i = 0; MIME_TYPES[i].ext; i++) {
+		if (!strcasecmp(&ext[1], MIME_TYPES[i].ext))
+			return MIME_TYPES[i].type;
+	}
+	return "application/octet-stream";
+}
+
+static void
+http_date(char *buf, time_t t)
+{
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	strftime(buf, HTTP_DATE_LEN, HTTP_DATE_FMT, &tm);
+}
+
+static bool
+parse_http_date(const char *s, time_t *out)
+{
+	struct tm tm;
+	const char *end;
+
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(s, HTTP_DATE_FMT, &tm);
+	if (!end || *end)
+		return false;
+
+	*out = timegm(&tm);
+	return true;
+}
+
+// parse_offset reads a non-negative decimal number from s, leaving
+// *end pointing after it.
+static bool
+parse_offset(const char *s, const char **end, off_t *out)
+{
+	long long n;
+	char *e;
+
+	if (*s < '0' || *s > '9')
+		return false;
+
+	errno = 0;
+	n = strtoll(s, &e, 10);
+	if (errno)
+		return false;
+
+	*out = n;
+	*end = e;
+	return true;
+}
+
+// parse_range interprets a Range header for a file of size bytes.
+// Only a single range is supported; for anything else we are allowed
+// to ignore the header and send the whole file.
+static enum RANGE
+parse_range(const char *hdr, off_t size, off_t *start, off_t *len)
+{
+	const char *s;
+	off_t first, last;
+
+	if (strncmp(hdr, "bytes=", 6) || strchr(hdr, ','))
+		return RANGE_NONE;
+	s = &hdr[6];
+
+	if (*s == '-') {
+		// the last N bytes
+		if (!parse_offset(&s[1], &s, &last) || *s)
+			return RANGE_NONE;
+		if (last == 0 || size == 0)
+			return RANGE_BAD;
+		if (last > size)
+			last = size;
+		*start = size - last;
+		*len = last;
+		return RANGE_OK;
+	}
+
+	if (!parse_offset(s, &s, &first) || *s++ != '-')
+		return RANGE_NONE;
+	if (*s) {
+		if (!parse_offset(s, &s, &last) || *s || last < first)
+			return RANGE_NONE;
+	} else {
+		last = size - 1;
+	}
+
+	if (first >= size)
+		return RANGE_BAD;
+	if (last >= size)
+		last = size - 1;
+
+	*start = first;
+	*len = last - first + 1;
+	return RANGE_OK;
+}
+
+// song_indexed looks path up in the music table, returning
+// SQLITE_ROW if it's there and SQLITE_DONE if it isn't.
+static int
+song_indexed(struct stmt_cache *stmts, const char *path)
+{
+	sqlite3_stmt *stmt;
+	uint64_t start;
+	int err;
+
+	stmt = stmt_cache_get(stmts, QUERY_PATH, PATH_QUERY);
+	if (!stmt)
+		return SQLITE_ERROR;
+
+	sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+	start = metrics_now();
+	err = sqlite3_step(stmt);
+	metrics_stmt(STMT_FILE, start);
+	stmt_cache_put(stmt);
+
+	return err;
+}
+
+void
+handle_file(struct evhttp_request *req, struct stmt_cache *stmts)
+{
+	struct evkeyvalq *headers, *out_headers;
+	struct evbuffer *buf;
+	struct stat st;
+	const char *hdr;
+	char *rel_path, *full_path;
+	char date[HTTP_DATE_LEN], content_range[80], content_len[24];
+	size_t len;
+	off_t start, count;
+	enum RANGE range;
+	time_t since;
+	int fd, err;
+
+	headers = evhttp_request_get_input_headers(req);
+	out_headers = evhttp_request_get_output_headers(req);
+
+	if (!(evhttp_request_get_command(req) &
+	      (EVHTTP_REQ_GET | EVHTTP_REQ_HEAD))) {
+		evhttp_add_header(out_headers, "Allow", "GET, HEAD");
+		evhttp_send_error(req, HTTP_BADMETHOD, NULL);
+		return;
+	}
+
+	// paths in the music table are relative to the music dir, and
+	// never contain a NUL.
+	rel_path = evhttp_uridecode(
+		&evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req))[
+			strlen(MUSIC_PREFIX)], 0, &len);
+	if (!rel_path || !len || strlen(rel_path) != len) {
+		free(rel_path);
+		evhttp_send_error(req, HTTP_BADREQUEST, NULL);
+		return;
+	}
+
+	// only serve what we have indexed, so that nothing else in (or
+	// outside of) the music dir can be fetched.
+	err = song_indexed(stmts, rel_path);
+	if (err != SQLITE_ROW) {
+		free(rel_path);
+		if (err == SQLITE_DONE)
+			evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+		else
+			evhttp_send_error(req, HTTP_SERVUNAVAIL, NULL);
+		return;
+	}
+
+	path_join(full_path, music_dir, rel_path);
+	free(rel_path);
+
+	fd = open(full_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+		return;
+	}
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		close(fd);
+		evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+		return;
+	}
+
+	http_date(date, st.st_mtime);
+	evhttp_add_header(out_headers, "Last-Modified", date);
+	evhttp_add_header(out_headers, "Accept-Ranges", "bytes");
+	evhttp_add_header(out_headers, "Content-Type", mime_type(full_path));
+
+	hdr = evhttp_find_header(headers, "If-Modified-Since");
+	if (hdr && parse_http_date(hdr, &since) && st.st_mtime <= since) {
+		close(fd);
+		evhttp_send_reply(req, HTTP_NOTMODIFIED, "Not Modified", NULL);
+		return;
+	}
+
+	start = 0;
+	count = st.st_size;
+	range = RANGE_NONE;
+	hdr = evhttp_find_header(headers, "Range");
+	if (hdr)
+		range = parse_range(hdr, st.st_size, &start, &count);
+
+	// If-Range asks for the range only if the file hasn't changed
+	// since the client fetched the rest of it.
+	if (range != RANGE_NONE &&
+	    (hdr = evhttp_find_header(headers, "If-Range")) &&
+	    (!parse_http_date(hdr, &since) || since != st.st_mtime)) {
+		range = RANGE_NONE;
+		start = 0;
+		count = st.st_size;
+	}
+
+	if (range == RANGE_BAD) {
+		close(fd);
+		snprintf(content_range, sizeof(content_range), "bytes */%lld",
+			 (long long)st.st_size);
+		evhttp_add_header(out_headers, "Content-Range", content_range);
+		evhttp_send_reply(req, HTTP_RANGE_NOT_SATISFIABLE,
+				  "Requested Range Not Satisfiable", NULL);
+		return;
+	}
+
+	buf = evbuffer_new();
+	if (!buf)
+		exit_perr("%s: evbuffer_new", __func__);
+
+	// the buffer takes ownership of fd, and libevent sends the file
+	// with sendfile rather than reading it into memory.
+	if (count == 0) {
+		close(fd);
+	} else if (evbuffer_add_file(buf, fd, start, count)) {
+		close(fd);
+		evbuffer_free(buf);
+		evhttp_send_error(req, HTTP_INTERNAL, NULL);
+		return;
+	}
+
+	// libevent only counts the body for us if it is going to send
+	// it, but a HEAD should describe the GET too.
+	snprintf(content_len, sizeof(content_len), "%lld", (long long)count);
+	evhttp_add_header(out_headers, "Content-Length", content_len);
+	// a HEAD gets the headers but none of the body, so count nothing.
+	if (evhttp_request_get_command(req) != EVHTTP_REQ_HEAD)
+		metrics_bytes(ROUTE_MUSIC, count);
+
+	if (range == RANGE_OK) {
+		snprintf(content_range, sizeof(content_range),
+			 "bytes %lld-%lld/%lld", (long long)start,
+			 (long long)(start + count - 1), (long long)st.st_size);
+		evhttp_add_header(out_headers, "Content-Range", content_range);
+		evhttp_send_reply(req, HTTP_PARTIAL, "Partial Content", buf);
+	} else {
+		evhttp_send_reply(req, HTTP_OK, "OK", buf);
+	}
+	evbuffer_free(buf);
+}
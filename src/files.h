@@ -0,0 +1,22 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#ifndef _FILES_H_
+#define _FILES_H_
+
+#include "common.h"
+
+// serves the music files themselves, under /music/<path>.  Only paths
+// the indexer has put in the music table are served, straight from
+// the page cache with sendfile.  Range requests (for seeking) and
+// conditional GETs on the file's mtime are supported.
+
+#define MUSIC_PREFIX "/music/"
+
+// sets the directory paths are relative to.  call before serving.
+void files_init(const char *dir);
+
+// replies to a request for MUSIC_PREFIX <path>.
+void handle_file(struct evhttp_request *req, struct stmt_cache *stmts);
+
+#endif // _FILES_H_
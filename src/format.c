@@ -0,0 +1,133 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#include "common.h"
+#include "format.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <strings.h>
+
+#include <event2/http.h>
+
+// buffers start with room for at least this much
+#define MIN_CAP (64)
+
+const struct format_ops *const formats[RESP_MAX] = {
+	[RESP_JSON] = &json_format,
+	[RESP_MSGPACK] = &msgpack_format,
+};
+
+void
+wbuf_init(struct wbuf *self, size_t cap)
+{
+	if (cap < MIN_CAP)
+		cap = MIN_CAP;
+	self->buf = xmalloc(cap);
+	self->len = 0;
+	self->cap = cap;
+}
+
+void
+wbuf_free(struct wbuf *self)
+{
+	free(self->buf);
+	self->buf = NULL;
+	self->len = 0;
+	self->cap = 0;
+}
+
+char *
+wbuf_release(struct wbuf *self)
+{
+	char *ret;
+
+	wbuf_char(self, '\0');
+	self->len--;
+
+	ret = self->buf;
+	self->buf = NULL;
+	self->cap = 0;
+	return ret;
+}
+
+void
+wbuf_grow(struct wbuf *self, size_t n)
+{
+	size_t cap;
+
+	cap = self->cap ? self->cap * 2 : MIN_CAP;
+	if (cap < self->len + n)
+		cap = self->len + n;
+
+	self->buf = realloc(self->buf, cap);
+	if (!self->buf)
+		exit_perr("realloc");
+	self->cap = cap;
+}
+
+// returns the quality the accept-params in [params, end) give, 1 if
+// they don't say.
+static double
+accept_q(const char *params, const char *end)
+{
+	for (const char *q = params; q < end; q++) {
+		if ((q[0] == 'q' || q[0] == 'Q') && q[1] == '=')
+			return strtod(&q[2], NULL);
+	}
+	return 1;
+}
+
+static bool
+is_msgpack(const char *type, size_t len)
+{
+	static const char *const TYPES[] = {
+		"application/msgpack",
+		"application/x-msgpack",
+		"application/vnd.msgpack",
+	};
+
+	for (size_t i = 0; i < sizeof(TYPES)/sizeof(TYPES[0]); i++) {
+		if (len == strlen(TYPES[i]) && !strncasecmp(type, TYPES[i], len))
+			return true;
+	}
+	return false;
+}
+
+enum RESP_KIND
+accept_kind(struct evhttp_request *req)
+{
+	const char *header, *p;
+	double msgpack, json;
+
+	header = evhttp_find_header(evhttp_request_get_input_headers(req),
+				    "Accept");
+	if (!header)
+		return RESP_JSON;
+
+	// wildcards don't count for JSON: it is what they get anyway.
+	msgpack = 0;
+	json = 0;
+	for (p = header; *p;) {
+		const char *end;
+		size_t len;
+
+		p += strspn(p, " \t,");
+		if (!*p)
+			break;
+		len = strcspn(p, ";, \t");
+		end = p + strcspn(p, ",");
+
+		if (is_msgpack(p, len))
+			msgpack = accept_q(&p[len], end);
+		else if (len == 16 && !strncasecmp(p, "application/json", len))
+			json = accept_q(&p[len], end);
+		p = end;
+	}
+
+	// a client that lists MessagePack at all would rather have it,
+	// unless it prefers JSON outright.
+	if (msgpack > 0 && msgpack >= json)
+		return RESP_MSGPACK;
+	return RESP_JSON;
+}
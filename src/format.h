@@ -0,0 +1,96 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#ifndef _FORMAT_H_
+#define _FORMAT_H_
+
+#include "common.h"
+
+// the formats responses can be written in (JSON by default, or
+// MessagePack for clients that ask for it), and the buffer they are
+// written into.
+
+// a response body being written, in one pass, into a buffer that
+// grows as needed.
+struct wbuf {
+	char *buf;
+	size_t len;
+	size_t cap;
+};
+
+// starts an empty buffer, with room for about cap bytes.
+void wbuf_init(struct wbuf *self, size_t cap);
+// frees the buffer, if it hasn't been handed off by wbuf_release.
+void wbuf_free(struct wbuf *self);
+// returns the NUL terminated contents, which the caller now owns.
+// their length is left in self->len.
+char *wbuf_release(struct wbuf *self);
+
+// makes room for n more bytes.
+void wbuf_grow(struct wbuf *self, size_t n);
+
+// appends len bytes of s as they are.
+static inline void
+wbuf_raw(struct wbuf *self, const void *s, size_t len)
+{
+	if (unlikely(self->cap - self->len < len))
+		wbuf_grow(self, len);
+	memcpy(&self->buf[self->len], s, len);
+	self->len += len;
+}
+
+static inline void
+wbuf_char(struct wbuf *self, char c)
+{
+	if (unlikely(self->len == self->cap))
+		wbuf_grow(self, 1);
+	self->buf[self->len++] = c;
+}
+
+// appends a string literal as it is.
+#define wbuf_lit(self, lit) wbuf_raw(self, lit, sizeof(lit) - 1)
+
+// a song, as every list of songs is made of.
+struct song_row {
+	const char *title;
+	const char *artist;
+	const char *album;
+	const char *path;
+	int track;
+	// in seconds
+	int time;
+};
+
+// writes the pieces of a response in one format.  Lists and maps are
+// written as their start, then each item (a list_item or map_key
+// before each), then their end.
+struct format_ops {
+	const char *content_type;
+	// starts a list of n items.  n is -1 if we don't know how many
+	// there will be yet; then the list has to be finished in the
+	// same buffer, by passing the mark returned here to list_end.
+	size_t (*list_start)(struct wbuf *out, int n);
+	// comes before item i
+	void (*list_item)(struct wbuf *out, int i);
+	void (*list_end)(struct wbuf *out, size_t mark, int n);
+	// starts a map of n entries
+	void (*map_start)(struct wbuf *out, int n);
+	// comes before the value of entry i
+	void (*map_key)(struct wbuf *out, int i, const char *key);
+	void (*map_end)(struct wbuf *out);
+	void (*string)(struct wbuf *out, const char *s);
+	void (*integer)(struct wbuf *out, int64_t v);
+	void (*song)(struct wbuf *out, const struct song_row *song);
+};
+
+extern const struct format_ops json_format;
+extern const struct format_ops msgpack_format;
+
+// the ops for each RESP_KIND
+extern const struct format_ops *const formats[RESP_MAX];
+
+// returns the format the client prefers, going by its Accept header.
+// JSON unless it asks for MessagePack.
+enum RESP_KIND accept_kind(struct evhttp_request *req);
+
+#endif // _FORMAT_H_
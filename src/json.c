@@ -0,0 +1,286 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#include "common.h"
+#include "format.h"
+#include "json.h"
+
+#include <stdio.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VEC_LEN (32)
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define VEC_LEN (16)
+#endif
+
+// the scan below reads whole aligned blocks, which may run past the
+// end of the string (though never into another page).
+#if defined(VEC_LEN) && defined(__SANITIZE_ADDRESS__)
+#define __no_asan __attribute__((no_sanitize_address))
+#else
+#define __no_asan
+#endif
+
+// bytes that can't go into a JSON string as they are: control
+// characters (and the NUL terminator), '"' and '\'.  Bytes past
+// ASCII are stopped at too, to check they are valid UTF-8.
+static inline bool
+is_special(unsigned char c)
+{
+	return c < 0x20 || c >= 0x80 || c == '"' || c == '\\';
+}
+
+#if defined(__AVX2__)
+// a bit set for every special byte in the 32 at p.  Compared as
+// signed, bytes past ASCII are negative, so they are less than ' '
+// along with the control characters.
+static inline __no_asan uint32_t
+special_mask(const char *p)
+{
+	__m256i v = _mm256_load_si256((const __m256i *)p);
+	__m256i m = _mm256_or_si256(
+		_mm256_cmpgt_epi8(_mm256_set1_epi8(' '), v),
+		_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))));
+	return _mm256_movemask_epi8(m);
+}
+#elif defined(__SSE2__)
+// as above, for the 16 bytes at p.
+static inline __no_asan uint32_t
+special_mask(const char *p)
+{
+	__m128i v = _mm_load_si128((const __m128i *)p);
+	__m128i m = _mm_or_si128(
+		_mm_cmplt_epi8(v, _mm_set1_epi8(' ')),
+		_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+			     _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))));
+	return _mm_movemask_epi8(m);
+}
+#endif
+
+// returns how many bytes at the start of s need no escaping.  Most
+// strings need none at all, so this is most of the work, and it is
+// done a vector at a time where we can.
+static __no_asan size_t
+plain_len(const char *s)
+{
+#ifdef VEC_LEN
+	const char *p;
+	uint32_t mask;
+	size_t off;
+
+	// aligned loads never cross a page boundary, so we can't fault
+	// reading the block past the terminator, or the one before s.
+	off = (uintptr_t)s % VEC_LEN;
+	p = s - off;
+	mask = special_mask(p) >> off;
+	if (mask)
+		return __builtin_ctz(mask);
+
+	for (p += VEC_LEN;; p += VEC_LEN) {
+		mask = special_mask(p);
+		if (mask)
+			return p - s + __builtin_ctz(mask);
+	}
+#else
+	const char *p;
+
+	for (p = s; !is_special(*p); p++)
+		;
+	return p - s;
+#endif
+}
+
+static inline bool
+is_cont(unsigned char c)
+{
+	return (c & 0xc0) == 0x80;
+}
+
+// returns the length of the UTF-8 sequence starting at s, or 0 if it
+// isn't a valid one (overlong, a surrogate, past U+10FFFF, or cut
+// short).
+static size_t
+utf8_len(const unsigned char *s)
+{
+	if (s[0] >= 0xc2 && s[0] <= 0xdf)
+		return is_cont(s[1]) ? 2 : 0;
+
+	if (s[0] >= 0xe0 && s[0] <= 0xef) {
+		if ((s[0] == 0xe0 && s[1] < 0xa0) ||
+		    (s[0] == 0xed && s[1] > 0x9f))
+			return 0;
+		return is_cont(s[1]) && is_cont(s[2]) ? 3 : 0;
+	}
+
+	if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+		if ((s[0] == 0xf0 && s[1] < 0x90) ||
+		    (s[0] == 0xf4 && s[1] > 0x8f))
+			return 0;
+		return is_cont(s[1]) && is_cont(s[2]) && is_cont(s[3]) ? 4 : 0;
+	}
+
+	return 0;
+}
+
+static void
+escape_char(struct wbuf *out, unsigned char c)
+{
+	static const char HEX[] = "0123456789abcdef";
+	char esc[6] = {'\\', 'u', '0', '0'};
+
+	switch (c) {
+	case '"':
+		wbuf_lit(out, "\\\"");
+		return;
+	case '\\':
+		wbuf_lit(out, "\\\\");
+		return;
+	case '\b':
+		wbuf_lit(out, "\\b");
+		return;
+	case '\f':
+		wbuf_lit(out, "\\f");
+		return;
+	case '\n':
+		wbuf_lit(out, "\\n");
+		return;
+	case '\r':
+		wbuf_lit(out, "\\r");
+		return;
+	case '\t':
+		wbuf_lit(out, "\\t");
+		return;
+	}
+
+	esc[4] = HEX[c >> 4];
+	esc[5] = HEX[c & 0xf];
+	wbuf_raw(out, esc, sizeof(esc));
+}
+
+void
+json_string(struct wbuf *out, const char *s)
+{
+	size_t n;
+
+	wbuf_char(out, '"');
+	for (;;) {
+		n = plain_len(s);
+		wbuf_raw(out, s, n);
+		s += n;
+
+		if (!*s)
+			break;
+
+		if ((unsigned char)*s >= 0x80) {
+			n = utf8_len((const unsigned char *)s);
+			if (n) {
+				wbuf_raw(out, s, n);
+				s += n;
+			} else {
+				wbuf_lit(out, "\\ufffd");
+				s++;
+			}
+			continue;
+		}
+
+		escape_char(out, *s++);
+	}
+	wbuf_char(out, '"');
+}
+
+static void
+json_integer(struct wbuf *out, int64_t v)
+{
+	char buf[20], *p;
+	uint64_t u;
+
+	// digits are written backwards from the end of buf
+	p = &buf[sizeof(buf)];
+	u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+	do {
+		*--p = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if (v < 0)
+		*--p = '-';
+
+	wbuf_raw(out, p, &buf[sizeof(buf)] - p);
+}
+
+static size_t
+json_list_start(struct wbuf *out, int n)
+{
+	wbuf_char(out, '[');
+	return 0;
+}
+
+static void
+json_list_item(struct wbuf *out, int i)
+{
+	if (i)
+		wbuf_char(out, ',');
+}
+
+static void
+json_list_end(struct wbuf *out, size_t mark, int n)
+{
+	wbuf_char(out, ']');
+}
+
+static void
+json_map_start(struct wbuf *out, int n)
+{
+	wbuf_char(out, '{');
+}
+
+static void
+json_map_key(struct wbuf *out, int i, const char *key)
+{
+	if (i)
+		wbuf_char(out, ',');
+	json_string(out, key);
+	wbuf_char(out, ':');
+}
+
+static void
+json_map_end(struct wbuf *out)
+{
+	wbuf_char(out, '}');
+}
+
+// the track is a string, as it always has been in JSON.
+static void
+json_song(struct wbuf *out, const struct song_row *song)
+{
+	char track[12];
+
+	snprintf(track, sizeof(track), "%d", song->track);
+
+	wbuf_lit(out, "{\"title\":");
+	json_string(out, song->title);
+	wbuf_lit(out, ",\"artist\":");
+	json_string(out, song->artist);
+	wbuf_lit(out, ",\"album\":");
+	json_string(out, song->album);
+	wbuf_lit(out, ",\"track\":");
+	json_string(out, track);
+	wbuf_lit(out, ",\"path\":");
+	json_string(out, song->path);
+	wbuf_char(out, '}');
+}
+
+const struct format_ops json_format = {
+	.content_type = "application/json; charset=UTF-8",
+	.list_start = json_list_start,
+	.list_item = json_list_item,
+	.list_end = json_list_end,
+	.map_start = json_map_start,
+	.map_key = json_map_key,
+	.map_end = json_map_end,
+	.string = json_string,
+	.integer = json_integer,
+	.song = json_song,
+};
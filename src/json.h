@@ -0,0 +1,19 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#ifndef _JSON_H_
+#define _JSON_H_
+
+#include "common.h"
+
+// JSON, the default response format (json_format in format.h).
+// Strings are escaped as JSON requires, and nothing more, so clients
+// get them back with a plain JSON parser.
+
+struct wbuf;
+
+// appends s as a quoted and escaped JSON string.  Bytes that aren't
+// valid UTF-8 (file names can be anything) become U+FFFD.
+void json_string(struct wbuf *out, const char *s);
+
+#endif // _JSON_H_
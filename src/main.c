@@ -7,6 +7,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <errno.h>
+#include <limits.h>
 #include <signal.h>
 #include <unistd.h>
 #include <getopt.h>
@@ -17,22 +19,38 @@
 #include <event2/http.h>
 #include <event2/http_struct.h>
 #include <event2/buffer.h>
+#include <event2/keyvalq_struct.h>
 
 #include <glib.h>
 
 #include "config.h"
 
 #include "common.h"
+#include "arena.h"
+#include "cache.h"
+#include "catalog.h"
+#include "compress.h"
+#include "db.h"
+#include "files.h"
+#include "format.h"
+#include "metrics.h"
 #include "queries.h"
 #include "dirwatch.h"
 #include "tags.h"
+#include "trace.h"
 #include "utils.h"
+#include "writer.h"
 
 
 static uint16_t DEFAULT_PORT = 1969;
 static const char *DEFAULT_ADDR = "127.0.0.1";
 static const char *DEFAULT_DIR = "~/Music";
 static const char *DEFAULT_DB = "~/.cnote.db";
+static const int DEFAULT_THREADS = 1;
+static const int MAX_THREADS = 256;
+// readers don't wait on the indexer in WAL mode, but can still be
+// held up briefly by a checkpoint or by recovery
+static const int READ_BUSY_TIMEOUT_MS = 2000;
 
 // global var available to various functions that want to report status
 const char *program_name;
@@ -42,26 +60,34 @@ static const struct option longopts[] =
 	{"address", required_argument, NULL, 'a'},
 	{"port", required_argument, NULL, 'p'},
 	{"dir", required_argument, NULL, 'd'},
+	{"threads", required_argument, NULL, 't'},
+	{"stream-rows", required_argument, NULL, 's'},
+	{"slow-ms", required_argument, NULL, 'l'},
+	{"mmap-size", required_argument, NULL, 'm'},
+	{"cache-size", required_argument, NULL, 'c'},
+	{"synchronous", required_argument, NULL, 'y'},
+	{"commit-rows", required_argument, NULL, 'r'},
+	{"commit-ms", required_argument, NULL, 'i'},
+	{"tag-threads", required_argument, NULL, 'T'},
+	{"full-scan", no_argument, NULL, 'f'},
 	{"help", no_argument, NULL, 'h'},
 	{"version", no_argument, NULL, 'v'},
 	{NULL, 0, NULL, 0}
 };
 
-static const char *INITIAL_STMTS[] =
-{
-	"CREATE TABLE IF NOT EXISTS music ("
-	"       path     varchar(512) PRIMARY KEY NOT NULL,"
-	"       title    varchar(256) NOT NULL,"
-	"       artist   varchar(256) NOT NULL,"
-	"       album    varchar(256) NOT NULL,"
-	"       track    int,"
-	"       time     int,"
-	"       modified int64"
-	")",
-	"CREATE INDEX IF NOT EXISTS i_album ON music(album)",
-	"CREATE INDEX IF NOT EXISTS i_artist ON music(artist)",
-	"CREATE INDEX IF NOT EXISTS i_full ON music(artist, album, title, track, path)",
-	NULL
+// each worker owns an event loop, an evhttp accepting on its own
+// SO_REUSEPORT socket and a read-only sqlite connection, which the
+// indexer's writes don't block (see db.h), so requests are served on
+// as many cores as there are workers without sharing any state on
+// the request path.
+struct worker {
+	pthread_t tinfo;
+	struct event_base *ev_base;
+	struct evhttp *ev_http;
+	sqlite3 *db;
+	struct stmt_cache stmts;
+	// what requests allocate, freed after each reply
+	struct arena arena;
 };
 
 // forward declarations
@@ -69,19 +95,27 @@ static void print_help(void);
 static void print_version(void);
 
 static void handle_unknown(struct evhttp_request *req, void *unused);
-static void handle_request(struct evhttp_request *req, struct ops *ops, sqlite3 *db);
-static void handle_req(struct evhttp_request *req, sqlite3 *db);
+static void handle_bad_request(struct evhttp_request *req, const char *why);
+static void handle_request(struct evhttp_request *req, struct ops *ops,
+			   struct worker *worker);
+static void handle_req(struct evhttp_request *req, struct worker *worker);
+
+static void worker_init(struct worker *self, const char *db_path,
+			const char *addr, const char *port, bool shared);
+static void *worker_routine(struct worker *self);
 
 static inline void set_content_type_json(struct evhttp_request *req);
 
 // callback typedef
 typedef void (*evhttp_cb)(struct evhttp_request *, void *);
 
+// the request lives in arena, and goes away when it is reset.
 static struct req *
-req_new(struct ops *ops, struct evhttp_request *req)
+req_new(struct arena *arena, struct ops *ops, struct evhttp_request *req)
 {
 	struct req *ret;
-	ret = xmalloc(sizeof(*ret));
+	ret = arena_calloc(arena, sizeof(*ret));
+	ret->arena = arena;
 	ret->ops = ops;
 	ret->req = req;
 	return ret;
@@ -91,26 +125,25 @@ req_new(struct ops *ops, struct evhttp_request *req)
 int
 main(int argc, char *const argv[])
 {
-	int optc, err;
+	int optc, err, nthreads, n;
 	uint16_t port;
 	wordexp_t w;
 	const char *addr, *dir, *db_path;
-	char *err_msg;
+	char port_str[8];
 	struct dirwatch *watch;
+	struct worker *workers;
 
 	sqlite3 *db;
 
-	struct evhttp *ev_http;
-	struct event_base *ev_base;
-
 	program_name = argv[0];
 	addr = DEFAULT_ADDR;
 	port = DEFAULT_PORT;
 	dir = DEFAULT_DIR;
+	nthreads = DEFAULT_THREADS;
 
 	// process arguments from the command line
 	while ((optc = getopt_long(argc, argv,
-				   "a:p:d:hv", longopts, NULL)) != -1) {
+				   "a:p:d:t:s:l:m:c:y:r:i:T:fhv", longopts, NULL)) != -1) {
 		switch (optc) {
 		// GNU standards have --help and --version exit immediately.
 		case 'v':
@@ -129,6 +162,57 @@ main(int argc, char *const argv[])
 		case 'd':
 			dir = (const char *)optarg;
 			break;
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads < 1 || nthreads > MAX_THREADS)
+				exit_msg("%s: threads must be between 1 and %d",
+					 program_name, MAX_THREADS);
+			break;
+		case 's':
+			stream_rows = atoi(optarg);
+			break;
+		case 'l':
+			slow_ms = atoi(optarg);
+			break;
+		case 'm':
+			n = atoi(optarg);
+			if (n < 0)
+				exit_msg("%s: mmap size can't be negative",
+					 program_name);
+			db_mmap_size = (int64_t)n * 1024 * 1024;
+			break;
+		case 'c':
+			db_cache_kib = atoi(optarg);
+			if (db_cache_kib < 1)
+				exit_msg("%s: cache size must be at least 1",
+					 program_name);
+			break;
+		case 'y':
+			if (!db_set_synchronous(optarg))
+				exit_msg("%s: synchronous must be one of off, "
+					 "normal, full or extra", program_name);
+			break;
+		case 'r':
+			commit_rows = atoi(optarg);
+			if (commit_rows < 1)
+				exit_msg("%s: commit rows must be at least 1",
+					 program_name);
+			break;
+		case 'i':
+			commit_ms = atoi(optarg);
+			if (commit_ms < 0)
+				exit_msg("%s: commit ms can't be negative",
+					 program_name);
+			break;
+		case 'f':
+			full_scan = true;
+			break;
+		case 'T':
+			tag_threads = atoi(optarg);
+			if (tag_threads < 0 || tag_threads > MAX_THREADS)
+				exit_msg("%s: tag threads must be between 0 "
+					 "and %d", program_name, MAX_THREADS);
+			break;
 		default:
 			fprintf(stderr, "unknown option '%c'", optc);
 			exit(EXIT_FAILURE);
@@ -151,78 +235,309 @@ main(int argc, char *const argv[])
 	if (sqlite3_threadsafe() == 0)
 		exit_msg("sqlite3 not configured to be thread safe, exiting");
 
-	err = sqlite3_open(db_path, &db);
-	if (err != SQLITE_OK)
-		exit_msg("couldn't open db");
-
-	for (const char **stmt = INITIAL_STMTS; *stmt; stmt++) {
-		err = sqlite3_exec(db, *stmt, NULL, NULL, &err_msg);
-		if (err != SQLITE_OK)
-			exit_msg("sqlite3 create error: %d (%s)", err, err_msg);
-	}
-
-	ev_base = event_base_new();
-	if (!ev_base)
-		exit_perr("main: event_base_new");
-
-	ev_http = evhttp_new(ev_base);
-	if (!ev_http)
-		exit_perr("main: evhttp_new");
-
-	err = evhttp_bind_socket(ev_http, addr, port);
-	if (err)
-		exit_msg("main: couldn't bind to %s:%d", addr, port);
-
-	// set the handlers for the api requests we care about, and set
-	// a generic error handler for everything else
-	evhttp_set_gencb(ev_http, (evhttp_cb)handle_req, db);
-
-	fprintf(stderr, "%s: initialized and waiting for connections\n",
-		program_name);
+	// this connection is the indexer's, once the catalog is loaded.
+	db = db_open_writer(db_path);
+	db_create(db);
+
+	// requests are served from memory, loaded once here and then
+	// kept up to date by the indexer.
+	catalog_load(db);
+	files_init(dir);
+
+	// every worker binds its own socket to the same addr:port, and
+	// the kernel spreads new connections across them.
+	snprintf(port_str, sizeof(port_str), "%u", port);
+	// SO_REUSEPORT would let us share the port with another cnote
+	// run by the same user, so first make sure nobody has it by
+	// binding it alone.
+	if (nthreads > 1)
+		close(get_tcp_socket(addr, port_str, false));
+	workers = xcalloc(nthreads * sizeof(*workers));
+	for (int i = 0; i < nthreads; i++)
+		worker_init(&workers[i], db_path, addr, port_str,
+			    nthreads > 1);
+
+	fprintf(stderr, "%s: initialized and waiting for connections "
+		"(%d threads)\n", program_name, nthreads);
 
 	watch = dirwatch_new();
 	watch->is_valid = is_valid_cb;
 	watch->is_modified = is_modified_cb;
+	watch->is_dir_modified = is_dir_modified_cb;
 	watch->on_delete = delete_cb;
 	watch->on_change = change_cb;
+	watch->on_crawled = crawled_cb;
+	watch->on_idle = idle_cb;
 	watch->cleanup = cleanup_cb;
 	watch->dir_name = dir;
-	watch->data = tags_init(db);
+	watch->data = tags_init(db, db_path);
 	if (watch->data == NULL) {
 		exit_msg("%s: couldn't connect to sqlite", program_name);
 	}
 	dirwatch_init(watch);
 
-	// the main event loop
-	event_base_dispatch(ev_base);
+	// the main thread runs the first worker's event loop itself.
+	for (int i = 1; i < nthreads; i++) {
+		err = pthread_create(&workers[i].tinfo, NULL,
+				     (pthread_routine)worker_routine,
+				     &workers[i]);
+		if (err)
+			exit_msg("main: pthread_create: %d", err);
+	}
+	worker_routine(&workers[0]);
+
+	for (int i = 1; i < nthreads; i++)
+		pthread_join(workers[i].tinfo, NULL);
+	free(workers);
+
+	// db belongs to the writer, which closes it (see tags_init).
+	return 0;
+}
+
+// worker_init sets up everything a worker needs to serve requests,
+// so that any errors (like the port being in use) are reported before
+// we start crawling the music directory.
+static void
+worker_init(struct worker *self, const char *db_path,
+	    const char *addr, const char *port, bool shared)
+{
+	int err, sock;
+
+	// each worker gets a private connection, so there is no need
+	// for sqlite to serialize access to it.
+	self->db = db_open_reader(db_path);
+	sqlite3_busy_timeout(self->db, READ_BUSY_TIMEOUT_MS);
+	stmt_cache_init(&self->stmts, self->db);
+	arena_init(&self->arena);
+
+	self->ev_base = event_base_new();
+	if (!self->ev_base)
+		exit_perr("%s: event_base_new", __func__);
+
+	self->ev_http = evhttp_new(self->ev_base);
+	if (!self->ev_http)
+		exit_perr("%s: evhttp_new", __func__);
+
+	sock = get_tcp_socket(addr, port, shared);
+	err = evhttp_accept_socket(self->ev_http, sock);
+	if (err)
+		exit_msg("%s: couldn't accept on %s:%s", __func__, addr, port);
+
+	// set the handlers for the api requests we care about, and set
+	// a generic error handler for everything else
+	evhttp_set_gencb(self->ev_http, (evhttp_cb)handle_req, self);
+}
+
+// worker_routine runs a worker's event loop until it is broken.
+static void *
+worker_routine(struct worker *self)
+{
+	int err;
 
-	err = sqlite3_close(db);
+	event_base_dispatch(self->ev_base);
+
+	evhttp_free(self->ev_http);
+	event_base_free(self->ev_base);
+	arena_destroy(&self->arena);
+	stmt_cache_clear(&self->stmts);
+	err = sqlite3_close(self->db);
 	if (err != SQLITE_OK)
 		exit_msg("close err: %d - %s\n", err,
-			 sqlite3_errmsg(db));
+			 sqlite3_errmsg(self->db));
 
-	return 0;
+	return NULL;
+}
+
+// parse_count parses a non-negative integer query parameter.
+static bool
+parse_count(const char *val, int *out)
+{
+	char *end;
+	long n;
+
+	errno = 0;
+	n = strtol(val, &end, 10);
+	if (errno || end == val || *end || n < 0 || n > INT_MAX)
+		return false;
+
+	*out = n;
+	return true;
+}
+
+// parse_page fills in page from the request's query parameters, and
+// returns false if they don't make sense.  page.after points into
+// params.
+static bool
+parse_page(struct page *page, struct evkeyvalq *params)
+{
+	const char *val;
+
+	page->paged = false;
+	page->offset = 0;
+	page->limit = -1;
+	page->after = NULL;
+
+	if ((val = evhttp_find_header(params, "offset"))) {
+		if (!parse_count(val, &page->offset))
+			return false;
+		page->paged = true;
+	}
+	if ((val = evhttp_find_header(params, "limit"))) {
+		if (!parse_count(val, &page->limit))
+			return false;
+		page->paged = true;
+	}
+	if ((val = evhttp_find_header(params, "after"))) {
+		page->after = val;
+		page->paged = true;
+	}
+
+	return true;
+}
+
+// artists and albums can be asked for by id under here
+#define ID_PREFIX "/id"
+
+// is_id_path returns true if name (what follows '/artist' or
+// '/album') is '/id', or starts with '/id/'.
+static bool
+is_id_path(const char *name)
+{
+	size_t len = strlen(ID_PREFIX);
+
+	return !strncmp(name, ID_PREFIX, len) &&
+		(name[len] == '\0' || name[len] == '/');
+}
+
+// parse_id parses a (positive, decimal) artist or album id, and
+// returns false if s isn't one.
+static bool
+parse_id(const char *s, int64_t *id)
+{
+	char *end;
+	long long val;
+
+	if (*s < '0' || *s > '9')
+		return false;
+	errno = 0;
+	val = strtoll(s, &end, 10);
+	if (errno || *end)
+		return false;
+
+	*id = val;
+	return true;
+}
+
+// parse_layout sets layout from the format= query parameter, and
+// returns false if it isn't one we know.
+static bool
+parse_layout(enum RESP_LAYOUT *layout, struct evkeyvalq *params)
+{
+	const char *val;
+
+	*layout = LAYOUT_ROWS;
+
+	val = evhttp_find_header(params, "format");
+	if (!val || !strcmp(val, "rows"))
+		return true;
+	if (!strcmp(val, "columnar")) {
+		*layout = LAYOUT_COLUMNS;
+		return true;
+	}
+
+	return false;
+}
+
+// trace_wanted returns true if the client asked for a breakdown of
+// where the time handling its request went.
+static bool
+trace_wanted(struct evhttp_request *req, struct evkeyvalq *params)
+{
+	const char *val;
+
+	val = evhttp_find_header(params, "trace");
+	if (!val)
+		val = evhttp_find_header(evhttp_request_get_input_headers(req),
+					 TRACE_HEADER);
+
+	return val && strcmp(val, "0");
+}
+
+// uri_unescape decodes the %XX escapes in s into arena.  Returns NULL
+// for a malformed escape, or one that decodes to a NUL.
+static char *
+uri_unescape(struct arena *arena, const char *s)
+{
+	char *ret, *p;
+	int hi, lo;
+
+	ret = arena_alloc(arena, strlen(s) + 1);
+	for (p = ret; *s; s++) {
+		if (*s != '%') {
+			*p++ = *s;
+			continue;
+		}
+		hi = g_ascii_xdigit_value(s[1]);
+		lo = hi < 0 ? -1 : g_ascii_xdigit_value(s[2]);
+		if (lo < 0 || (hi == 0 && lo == 0))
+			return NULL;
+		*p++ = hi << 4 | lo;
+		s += 2;
+	}
+	*p = '\0';
+
+	return ret;
 }
 
 // handle_request is called when we get a request for a resource like
 // '/albums' or '/album/Album Of The Year'
 static void
-handle_request(struct evhttp_request *req, struct ops *req_type, sqlite3 *db)
+handle_request(struct evhttp_request *req, struct ops *req_type,
+	       struct worker *worker)
 {
 	struct req *request;
-	const char *name;
-	const char *result;
+	const char *path, *name;
+	const struct evhttp_uri *uri;
+	struct evkeyvalq params;
+	struct response *result;
 	struct evbuffer *buf;
 
-	// we always return JSON
-	set_content_type_json(req);
-
 	// handle request is called with a given request type - either
 	// artist or album.  If we've gotten an invalid API request
 	// (like '/hack'), handle_request wouldn't have been called.,
 	// so we know we've got either a artist or album request here.
-	request = req_new(req_type, req);
-	request->db = db;
+	request = req_new(&worker->arena, req_type, req);
+	trace_start(&request->trace, req);
+	request->stmts = &worker->stmts;
+	request->kind = accept_kind(req);
+	request->encoding = accept_encoding(req);
+	evhttp_add_header(req->output_headers, "Content-Type",
+			  formats[request->kind]->content_type);
+	evhttp_add_header(req->output_headers, "Vary",
+			  "Accept, Accept-Encoding");
+
+	// split off the query string, which says what part of the
+	// result the client wants.
+	uri = evhttp_request_get_evhttp_uri(req);
+	path = evhttp_uri_get_path(uri);
+	if (evhttp_parse_query_str(evhttp_uri_get_query(uri) ?: "", &params)) {
+		handle_bad_request(req, "malformed query string");
+		goto out;
+	}
+	if (!parse_page(&request->page, &params)) {
+		evhttp_clear_headers(&params);
+		handle_bad_request(req, "bad offset, limit or after");
+		goto out;
+	}
+	if (!parse_layout(&request->layout, &params)) {
+		evhttp_clear_headers(&params);
+		handle_bad_request(req, "bad format");
+		goto out;
+	}
+	request->terms = evhttp_find_header(&params, "q");
+	request->prefix = evhttp_find_header(&params, "prefix");
+	trace_want(&request->trace, trace_wanted(req, &params));
+	trace_phase(&request->trace, "parse");
 
 	// find the string that starts with the second '/', if there
 	// is a second backslash.  if there IS another '/', it means
@@ -230,24 +545,99 @@ handle_request(struct evhttp_request *req, struct ops *req_type, sqlite3 *db)
 	// '/artist/Jay-Z' or '/album/The Blueprint'.  If there is
 	// only 1 slash, we're getting info about all artists or all
 	// albums.
-	name = strchr(&evhttp_request_get_uri(req)[1], '/');
+	name = strchr(&path[1], '/');
 
 	// read as: if we don't have a request name or if the request
 	// name is (exactly) the string "/", list the albums, else...
 	if (!name || !strcmp(name, "/")) {
 		result = request->ops->list(request);
+	} else if (request->ops->query_id && is_id_path(name)) {
+		// '/album/id' or '/album/id/123'.  A name that really
+		// is 'id/...' can be asked for with its '/' escaped.
+		int64_t id;
+
+		name += strlen(ID_PREFIX);
+		if (!*name || !strcmp(name, "/")) {
+			result = request->ops->list_ids(request);
+		} else if (parse_id(&name[1], &id)) {
+			result = request->ops->query_id(request, id);
+		} else {
+			evhttp_clear_headers(&params);
+			handle_bad_request(req, "bad id");
+			goto out;
+		}
 	} else {
 		char *real_name;
-		real_name = g_uri_unescape_string(&name[1], NULL);
+		real_name = uri_unescape(request->arena, &name[1]);
+		if (!real_name) {
+			evhttp_clear_headers(&params);
+			handle_bad_request(req, "malformed name");
+			goto out;
+		}
 		result = request->ops->query(request, real_name);
-		free(real_name);
+	}
+	evhttp_clear_headers(&params);
+
+	// either the client already has this version, and doesn't
+	// need a body, or the ops are sending it piece by piece (or
+	// couldn't get it at all).
+	if (!result) {
+		if (request->failed) {
+			trace_header(&request->trace, req);
+			evhttp_send_error(req, HTTP_INTERNAL, NULL);
+			trace_phase(&request->trace, "send");
+		} else if (!request->streamed) {
+			trace_header(&request->trace, req);
+			evhttp_send_reply(req, HTTP_NOTMODIFIED,
+					  "Not Modified", NULL);
+			trace_phase(&request->trace, "send");
+		}
+		trace_finish(&request->trace);
+		goto out;
 	}
 
 	buf = evbuffer_new();
 	if (!buf)
 		exit_perr("%s: evbuffer_new", __func__);
-	evbuffer_add_reference(buf, result, strlen(result), free_cb, NULL);
+	if (result->encoding != ENC_IDENTITY)
+		evhttp_add_header(req->output_headers, "Content-Encoding",
+				  encoding_name(result->encoding));
+
+	// the body is shared with the response cache, not copied.
+	response_add_to(result, buf);
+	// libevent sends none of the body for a HEAD.
+	if (evhttp_request_get_command(req) != EVHTTP_REQ_HEAD)
+		metrics_bytes(metrics_route(), evbuffer_get_length(buf));
+	response_unref(result);
+	trace_header(&request->trace, req);
 	evhttp_send_reply(req, HTTP_OK, "OK", buf);
+	trace_phase(&request->trace, "send");
+	evbuffer_free(buf);
+	trace_finish(&request->trace);
+out:
+	// nothing allocated for the request is needed once the reply
+	// is on its way: bodies are refcounted or copied, and streams
+	// keep what they need themselves.
+	arena_reset(request->arena);
+}
+
+// handle_bad_request tells the client that we couldn't make sense of
+// an otherwise valid API call.
+static void
+handle_bad_request(struct evhttp_request *req, const char *why)
+{
+	struct evbuffer *buf;
+
+	buf = evbuffer_new();
+	if (!buf)
+		exit_perr("%s: evbuffer_new", __func__);
+
+	// errors are always JSON, whatever the client asked for.
+	evhttp_remove_header(req->output_headers, "Content-Type");
+	set_content_type_json(req);
+
+	evbuffer_add_printf(buf, "\"bad request: %s\"", why);
+	evhttp_send_reply(req, HTTP_BADREQUEST, "Bad Request", buf);
 	evbuffer_free(buf);
 }
 
@@ -273,30 +663,54 @@ handle_unknown(struct evhttp_request *req, void *unused __unused)
 
 #define ARTIST "/artist"
 #define ALBUM "/album"
+#define SEARCH "/search"
+#define COMPLETE "/complete"
 
 // handle_req is the root request handler It is called for each
 // request before handle_request and decides if this is a valid client
 // request or not.
 static void
-handle_req(struct evhttp_request *req, sqlite3 *db)
+handle_req(struct evhttp_request *req, struct worker *worker)
 {
 	const char *path;
 
 	path = evhttp_request_get_uri(req);
-
-	if (strncmp(ARTIST, path, strlen(ARTIST)) == 0)
-		handle_request(req, &artist_ops, db);
-	else if (strncmp(ALBUM, path, strlen(ALBUM)) == 0)
-		handle_request(req, &album_ops, db);
-	else
+	// libevent calls us back without a uri when a client goes away
+	// while its (streamed) reply is still being sent.  The stream
+	// cleans up after itself when the connection is closed.
+	if (!path)
+		return;
+
+	if (strncmp(ARTIST, path, strlen(ARTIST)) == 0) {
+		metrics_request_start(ROUTE_ARTIST);
+		handle_request(req, &artist_ops, worker);
+	} else if (strncmp(ALBUM, path, strlen(ALBUM)) == 0) {
+		metrics_request_start(ROUTE_ALBUM);
+		handle_request(req, &album_ops, worker);
+	} else if (strncmp(SEARCH, path, strlen(SEARCH)) == 0) {
+		metrics_request_start(ROUTE_SEARCH);
+		handle_request(req, &search_ops, worker);
+	} else if (strncmp(COMPLETE, path, strlen(COMPLETE)) == 0) {
+		metrics_request_start(ROUTE_COMPLETE);
+		handle_request(req, &complete_ops, worker);
+	} else if (strncmp(MUSIC_PREFIX, path, strlen(MUSIC_PREFIX)) == 0) {
+		metrics_request_start(ROUTE_MUSIC);
+		handle_file(req, &worker->stmts);
+	} else if (strcmp(METRICS_PATH, path) == 0) {
+		metrics_request_start(ROUTE_METRICS);
+		handle_metrics(req);
+	} else {
+		metrics_request_start(ROUTE_UNKNOWN);
 		handle_unknown(req, NULL);
+	}
+	metrics_request_end();
 }
 
 static void
 print_help()
 {
 	printf("\
-Usage: %s [-aphv]\n", program_name);
+Usage: %s [-apdtslmcyriTfhv]\n", program_name);
 	printf("\
 RESTful access to data about your music collection.\n\n\
 Options:\n");
@@ -314,6 +728,41 @@ Options:\n");
 	printf("\
   -d, --dir=DIR       directory where music lives\n\
                       (default: ~/Music)\n");
+	printf("\
+  -t, --threads=N     number of threads serving requests\n\
+                      (default: 1)\n");
+	printf("\
+  -s, --stream-rows=N stream results with more than N rows in\n\
+                      chunks instead of caching them, 0 to never\n\
+                      stream (default: 10000)\n");
+	printf("\
+  -l, --slow-ms=MS    log requests that take longer than MS\n\
+                      milliseconds, at most one a second per\n\
+                      thread, 0 to never log (default: 0)\n");
+	printf("\
+  -m, --mmap-size=MB  read up to MB megabytes of the database\n\
+                      through mmap, 0 to not (default: 256)\n");
+	printf("\
+  -c, --cache-size=KB sqlite page cache for each connection, in\n\
+                      kilobytes (default: 8192)\n");
+	printf("\
+  -y, --synchronous=MODE\n\
+                      how often the indexer syncs the database:\n\
+                      off, normal, full or extra (default: normal)\n");
+	printf("\
+  -r, --commit-rows=N the indexer commits after writing N songs\n\
+                      (default: 8192)\n");
+	printf("\
+  -i, --commit-ms=MS  or MS milliseconds after the first of them\n\
+                      (default: 1000)\n");
+	printf("\
+  -T, --tag-threads=N number of threads reading tags from music\n\
+                      files, 0 for one per cpu (default: 0)\n");
+	printf("\
+  -f, --full-scan     check every file for changes at startup, not\n\
+                      just those in directories that have changed\n\
+                      (without it, a file retagged in place while\n\
+                      cnote wasn't running is missed)\n");
 	printf("\n");
 	printf("\
 Report bugs to <%s>.\n", PACKAGE_BUGREPORT);
@@ -0,0 +1,329 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#include "common.h"
+#include "metrics.h"
+#include "utils.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <event2/buffer.h>
+#include <event2/http.h>
+
+#define NS_PER_SEC (1000000000ULL)
+#define CACHE_LINE (64)
+
+// upper bounds of the request latency histogram buckets, in
+// nanoseconds.  There is an implicit +Inf bucket after the last.
+static const uint64_t LATENCY_BOUNDS[] = {
+	50000, 100000, 250000, 500000,
+	1000000, 2500000, 5000000, 10000000,
+	25000000, 50000000, 100000000, 250000000,
+	500000000, 1000000000,
+};
+#define NBUCKETS (sizeof(LATENCY_BOUNDS)/sizeof(LATENCY_BOUNDS[0]) + 1)
+
+static const char *const ROUTE_NAMES[ROUTE_MAX] = {
+	[ROUTE_ARTIST] = "artist",
+	[ROUTE_ALBUM] = "album",
+	[ROUTE_SEARCH] = "search",
+	[ROUTE_COMPLETE] = "complete",
+	[ROUTE_MUSIC] = "music",
+	[ROUTE_METRICS] = "metrics",
+	[ROUTE_UNKNOWN] = "unknown",
+};
+
+static const char *const STMT_NAMES[STMT_MAX] = {
+	[STMT_LOAD] = "load",
+	[STMT_MODIFIED] = "modified",
+	[STMT_INSERT] = "insert",
+	[STMT_UPDATE] = "update",
+	[STMT_DELETE] = "delete",
+	[STMT_GROUPS] = "groups",
+	[STMT_DIRS] = "dirs",
+	[STMT_COMMIT] = "commit",
+	[STMT_SEARCH] = "search",
+	[STMT_FILE] = "file",
+};
+
+// one thread's counters.  only the owning thread writes them, and
+// scrapes read them, so neither side needs a lock or an atomic
+// read-modify-write.  Buckets are not cumulative; that is done when
+// they are exported.
+struct shard {
+	struct shard *next;
+	uint64_t requests[ROUTE_MAX];
+	uint64_t bytes[ROUTE_MAX];
+	uint64_t latency_ns[ROUTE_MAX];
+	uint64_t latency[ROUTE_MAX][NBUCKETS];
+	uint64_t indexer[IDX_MAX];
+	uint64_t stmts[STMT_MAX];
+	uint64_t stmt_ns[STMT_MAX];
+} __attribute__((aligned(CACHE_LINE)));
+
+// every thread's shard, pushed on as threads first record something.
+static struct shard *shards;
+static int watches;
+
+static __thread struct shard *local;
+// the request this thread is handling
+static __thread enum ROUTE route;
+static __thread uint64_t route_start;
+
+static struct shard *
+shard_new(void)
+{
+	struct shard *ret;
+
+	// the size of a shard is a multiple of its alignment.
+	ret = aligned_alloc(CACHE_LINE, sizeof(*ret));
+	if (unlikely(!ret))
+		exit_perr("%s: aligned_alloc", __func__);
+	memset(ret, 0, sizeof(*ret));
+
+	ret->next = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&shards, &ret->next, ret, true,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	return ret;
+}
+
+static inline struct shard *
+shard_get(void)
+{
+	if (unlikely(!local))
+		local = shard_new();
+	return local;
+}
+
+// counter += n, for a counter only the current thread writes.
+static inline void
+add(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+			 __ATOMIC_RELAXED);
+}
+
+static inline uint64_t
+get(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+uint64_t
+metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+void
+metrics_request_start(enum ROUTE r)
+{
+	route = r;
+	route_start = metrics_now();
+	add(&shard_get()->requests[r], 1);
+}
+
+void
+metrics_request_end(void)
+{
+	struct shard *shard;
+	uint64_t elapsed;
+	size_t i;
+
+	shard = shard_get();
+	elapsed = metrics_now() - route_start;
+
+	for (i = 0; i < NBUCKETS - 1; i++) {
+		if (elapsed <= LATENCY_BOUNDS[i])
+			break;
+	}
+	add(&shard->latency[route][i], 1);
+	add(&shard->latency_ns[route], elapsed);
+}
+
+enum ROUTE
+metrics_route(void)
+{
+	return route;
+}
+
+void
+metrics_bytes(enum ROUTE r, size_t len)
+{
+	add(&shard_get()->bytes[r], len);
+}
+
+void
+metrics_indexer(enum INDEXER_COUNTER counter)
+{
+	add(&shard_get()->indexer[counter], 1);
+}
+
+void
+metrics_watches(int n)
+{
+	__atomic_store_n(&watches, n, __ATOMIC_RELAXED);
+}
+
+void
+metrics_stmt(enum STMT stmt, uint64_t start)
+{
+	struct shard *shard;
+
+	shard = shard_get();
+	add(&shard->stmts[stmt], 1);
+	add(&shard->stmt_ns[stmt], metrics_now() - start);
+}
+
+// adds up every thread's counters.
+static void
+metrics_sum(struct shard *total)
+{
+	struct shard *shard;
+
+	memset(total, 0, sizeof(*total));
+
+	shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+	for (; shard; shard = shard->next) {
+		for (int r = 0; r < ROUTE_MAX; r++) {
+			total->requests[r] += get(&shard->requests[r]);
+			total->bytes[r] += get(&shard->bytes[r]);
+			total->latency_ns[r] += get(&shard->latency_ns[r]);
+			for (size_t i = 0; i < NBUCKETS; i++)
+				total->latency[r][i] += get(&shard->latency[r][i]);
+		}
+		for (int c = 0; c < IDX_MAX; c++)
+			total->indexer[c] += get(&shard->indexer[c]);
+		for (int s = 0; s < STMT_MAX; s++) {
+			total->stmts[s] += get(&shard->stmts[s]);
+			total->stmt_ns[s] += get(&shard->stmt_ns[s]);
+		}
+	}
+}
+
+static void
+add_header(struct evbuffer *buf, const char *name, const char *type,
+	   const char *help)
+{
+	evbuffer_add_printf(buf, "# HELP %s %s\n# TYPE %s %s\n",
+			    name, help, name, type);
+}
+
+static void
+add_seconds(struct evbuffer *buf, uint64_t ns)
+{
+	evbuffer_add_printf(buf, "%llu.%09llu\n",
+			    (unsigned long long)(ns / NS_PER_SEC),
+			    (unsigned long long)(ns % NS_PER_SEC));
+}
+
+static void
+add_counter(struct evbuffer *buf, const char *name, const char *help,
+	    uint64_t val)
+{
+	add_header(buf, name, "counter", help);
+	evbuffer_add_printf(buf, "%s %llu\n", name, (unsigned long long)val);
+}
+
+void
+handle_metrics(struct evhttp_request *req)
+{
+	static struct shard total;
+	static pthread_mutex_t total_lock = PTHREAD_MUTEX_INITIALIZER;
+	struct evbuffer *buf;
+
+	buf = evbuffer_new();
+	if (!buf)
+		exit_perr("%s: evbuffer_new", __func__);
+
+	// the totals are too big for the stack, and scrapes are rare.
+	pthread_mutex_lock(&total_lock);
+	metrics_sum(&total);
+
+	add_header(buf, "cnote_http_requests_total", "counter",
+		   "Requests received, by route.");
+	for (int r = 0; r < ROUTE_MAX; r++)
+		evbuffer_add_printf(buf, "cnote_http_requests_total"
+				    "{route=\"%s\"} %llu\n", ROUTE_NAMES[r],
+				    (unsigned long long)total.requests[r]);
+
+	add_header(buf, "cnote_http_request_duration_seconds", "histogram",
+		   "Time spent handling a request, until its response "
+		   "is handed to libevent.");
+	for (int r = 0; r < ROUTE_MAX; r++) {
+		uint64_t count = 0;
+		for (size_t i = 0; i < NBUCKETS; i++) {
+			count += total.latency[r][i];
+			if (i < NBUCKETS - 1)
+				evbuffer_add_printf(
+					buf, "cnote_http_request_duration_"
+					"seconds_bucket{route=\"%s\",le=\"%g\"}"
+					" %llu\n", ROUTE_NAMES[r],
+					(double)LATENCY_BOUNDS[i] / NS_PER_SEC,
+					(unsigned long long)count);
+			else
+				evbuffer_add_printf(
+					buf, "cnote_http_request_duration_"
+					"seconds_bucket{route=\"%s\",le=\"+Inf\"}"
+					" %llu\n", ROUTE_NAMES[r],
+					(unsigned long long)count);
+		}
+		evbuffer_add_printf(buf, "cnote_http_request_duration_seconds"
+				    "_sum{route=\"%s\"} ", ROUTE_NAMES[r]);
+		add_seconds(buf, total.latency_ns[r]);
+		evbuffer_add_printf(buf, "cnote_http_request_duration_seconds"
+				    "_count{route=\"%s\"} %llu\n",
+				    ROUTE_NAMES[r], (unsigned long long)count);
+	}
+
+	add_header(buf, "cnote_http_response_bytes_total", "counter",
+		   "Response body bytes sent, by route.");
+	for (int r = 0; r < ROUTE_MAX; r++)
+		evbuffer_add_printf(buf, "cnote_http_response_bytes_total"
+				    "{route=\"%s\"} %llu\n", ROUTE_NAMES[r],
+				    (unsigned long long)total.bytes[r]);
+
+	add_counter(buf, "cnote_indexer_files_processed_total",
+		    "Music files whose tags were read into the db.",
+		    total.indexer[IDX_FILES]);
+	add_counter(buf, "cnote_indexer_deletes_total",
+		    "Music files removed from the db.",
+		    total.indexer[IDX_DELETES]);
+	add_counter(buf, "cnote_indexer_commits_total",
+		    "Transactions the indexer's changes were written in.",
+		    total.indexer[IDX_COMMITS]);
+	add_counter(buf, "cnote_indexer_dirs_skipped_total",
+		    "Directories unchanged since the last crawl, whose files "
+		    "weren't looked at.", total.indexer[IDX_DIRS_SKIPPED]);
+	add_counter(buf, "cnote_indexer_inotify_events_total",
+		    "inotify events read.", total.indexer[IDX_EVENTS]);
+	add_header(buf, "cnote_indexer_watches", "gauge",
+		   "Directories watched for changes.");
+	evbuffer_add_printf(buf, "cnote_indexer_watches %d\n",
+			    __atomic_load_n(&watches, __ATOMIC_RELAXED));
+
+	add_header(buf, "cnote_sqlite_statement_seconds", "summary",
+		   "Time spent stepping sqlite statements, by statement.");
+	for (int s = 0; s < STMT_MAX; s++) {
+		evbuffer_add_printf(buf, "cnote_sqlite_statement_seconds_sum"
+				    "{stmt=\"%s\"} ", STMT_NAMES[s]);
+		add_seconds(buf, total.stmt_ns[s]);
+		evbuffer_add_printf(buf, "cnote_sqlite_statement_seconds_count"
+				    "{stmt=\"%s\"} %llu\n", STMT_NAMES[s],
+				    (unsigned long long)total.stmts[s]);
+	}
+	pthread_mutex_unlock(&total_lock);
+
+	metrics_bytes(ROUTE_METRICS, evbuffer_get_length(buf));
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+			  "Content-Type", "text/plain; version=0.0.4");
+	evhttp_send_reply(req, HTTP_OK, "OK", buf);
+	evbuffer_free(buf);
+}
@@ -0,0 +1,72 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "common.h"
+
+// counters exported on /metrics in the Prometheus text format.  Every
+// thread records into its own set of counters, which only it writes,
+// so recording is a couple of uncontended memory operations.  A
+// scrape adds up every thread's counters.
+
+#define METRICS_PATH "/metrics"
+
+enum ROUTE {
+	ROUTE_ARTIST,
+	ROUTE_ALBUM,
+	ROUTE_SEARCH,
+	ROUTE_COMPLETE,
+	ROUTE_MUSIC,
+	ROUTE_METRICS,
+	ROUTE_UNKNOWN,
+	ROUTE_MAX
+};
+
+enum INDEXER_COUNTER {
+	// files whose tags were (re)read into the db
+	IDX_FILES,
+	IDX_DELETES,
+	IDX_COMMITS,
+	IDX_DIRS_SKIPPED,
+	IDX_EVENTS,
+	IDX_MAX
+};
+
+// sqlite statements we time
+enum STMT {
+	STMT_LOAD,
+	STMT_MODIFIED,
+	STMT_INSERT,
+	STMT_UPDATE,
+	STMT_DELETE,
+	STMT_GROUPS,
+	STMT_DIRS,
+	STMT_COMMIT,
+	STMT_SEARCH,
+	STMT_FILE,
+	STMT_MAX
+};
+
+// nanoseconds on the monotonic clock
+uint64_t metrics_now(void);
+
+// brackets the handling of a request on the current thread.
+void metrics_request_start(enum ROUTE route);
+void metrics_request_end(void);
+// the route of the request the current thread is handling.
+enum ROUTE metrics_route(void);
+// counts len bytes of response body sent for route.
+void metrics_bytes(enum ROUTE route, size_t len);
+
+void metrics_indexer(enum INDEXER_COUNTER counter);
+// the number of directories being watched for changes
+void metrics_watches(int n);
+// records one run of stmt, which started at start (see metrics_now).
+void metrics_stmt(enum STMT stmt, uint64_t start);
+
+// replies to a scrape of METRICS_PATH.
+void handle_metrics(struct evhttp_request *req);
+
+#endif // _METRICS_H_
@@ -0,0 +1,194 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+
+// MessagePack (https://msgpack.org), for clients that would rather
+// not parse JSON.  Songs are maps with the same keys as in JSON, plus
+// the time, and the track and time are integers.
+#include "common.h"
+#include "format.h"
+
+#include <glib.h>
+
+// what list_start returns when the list's length is already written
+#define NO_MARK ((size_t)-1)
+
+// writes tag followed by the low bytes of v, big-endian.
+static void
+put_be(struct wbuf *out, uint8_t tag, uint64_t v, int bytes)
+{
+	char buf[9];
+
+	buf[0] = tag;
+	for (int i = 0; i < bytes; i++)
+		buf[1 + i] = v >> (8 * (bytes - 1 - i));
+	wbuf_raw(out, buf, 1 + bytes);
+}
+
+static void
+mp_int(struct wbuf *out, int64_t v)
+{
+	if (v >= 0) {
+		if (v < 0x80)
+			wbuf_char(out, v);
+		else if (v <= UINT8_MAX)
+			put_be(out, 0xcc, v, 1);
+		else if (v <= UINT16_MAX)
+			put_be(out, 0xcd, v, 2);
+		else if (v <= UINT32_MAX)
+			put_be(out, 0xce, v, 4);
+		else
+			put_be(out, 0xcf, v, 8);
+	} else {
+		if (v >= -32)
+			wbuf_char(out, v);
+		else if (v >= INT8_MIN)
+			put_be(out, 0xd0, v, 1);
+		else if (v >= INT16_MIN)
+			put_be(out, 0xd1, v, 2);
+		else if (v >= INT32_MIN)
+			put_be(out, 0xd2, v, 4);
+		else
+			put_be(out, 0xd3, v, 8);
+	}
+}
+
+// the header for an array or map of n items; fix is the tag of the
+// smallest form, and tag16 of the 16 bit one (the 32 bit one follows).
+static void
+mp_header(struct wbuf *out, uint32_t n, uint8_t fix, uint8_t tag16)
+{
+	if (n < 16)
+		wbuf_char(out, fix | n);
+	else if (n <= UINT16_MAX)
+		put_be(out, tag16, n, 2);
+	else
+		put_be(out, tag16 + 1, n, 4);
+}
+
+// returns whether the len bytes at s are all ASCII, a word at a time.
+static bool
+is_ascii(const char *s, size_t len)
+{
+	uint64_t bits, w;
+	size_t i;
+
+	bits = 0;
+	for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(&w, &s[i], sizeof(w));
+		bits |= w;
+	}
+	for (; i < len; i++)
+		bits |= (unsigned char)s[i];
+	return !(bits & 0x8080808080808080ULL);
+}
+
+// MessagePack strings are UTF-8 too, so bytes that aren't valid
+// become U+FFFD, as they do in JSON.  Most strings are plain ASCII,
+// which is checked for first as it is much quicker.
+static void
+mp_string(struct wbuf *out, const char *s)
+{
+	char *valid;
+	size_t len;
+
+	valid = NULL;
+	len = strlen(s);
+	if (!is_ascii(s, len) && unlikely(!g_utf8_validate(s, len, NULL))) {
+		valid = g_utf8_make_valid(s, len);
+		s = valid;
+		len = strlen(s);
+	}
+
+	if (len < 32)
+		wbuf_char(out, 0xa0 | len);
+	else if (len <= UINT8_MAX)
+		put_be(out, 0xd9, len, 1);
+	else if (len <= UINT16_MAX)
+		put_be(out, 0xda, len, 2);
+	else
+		put_be(out, 0xdb, len, 4);
+	wbuf_raw(out, s, len);
+
+	g_free(valid);
+}
+
+// a list of unknown length gets the biggest header, which is filled
+// in by mp_list_end.
+static size_t
+mp_list_start(struct wbuf *out, int n)
+{
+	size_t mark;
+
+	if (n >= 0) {
+		mp_header(out, n, 0x90, 0xdc);
+		return NO_MARK;
+	}
+
+	mark = out->len;
+	put_be(out, 0xdd, 0, 4);
+	return mark;
+}
+
+static void
+mp_list_item(struct wbuf *out, int i)
+{
+}
+
+static void
+mp_list_end(struct wbuf *out, size_t mark, int n)
+{
+	if (mark == NO_MARK)
+		return;
+
+	for (int i = 0; i < 4; i++)
+		out->buf[mark + 1 + i] = (uint32_t)n >> (8 * (3 - i));
+}
+
+static void
+mp_map_start(struct wbuf *out, int n)
+{
+	mp_header(out, n, 0x80, 0xde);
+}
+
+static void
+mp_map_key(struct wbuf *out, int i, const char *key)
+{
+	mp_string(out, key);
+}
+
+static void
+mp_map_end(struct wbuf *out)
+{
+}
+
+static void
+mp_song(struct wbuf *out, const struct song_row *song)
+{
+	// a map of 6 entries, and keys as short strings
+	wbuf_lit(out, "\x86\xa5title");
+	mp_string(out, song->title);
+	wbuf_lit(out, "\xa6" "artist");
+	mp_string(out, song->artist);
+	wbuf_lit(out, "\xa5" "album");
+	mp_string(out, song->album);
+	wbuf_lit(out, "\xa5track");
+	mp_int(out, song->track);
+	wbuf_lit(out, "\xa4time");
+	mp_int(out, song->time);
+	wbuf_lit(out, "\xa4path");
+	mp_string(out, song->path);
+}
+
+const struct format_ops msgpack_format = {
+	.content_type = "application/msgpack",
+	.list_start = mp_list_start,
+	.list_item = mp_list_item,
+	.list_end = mp_list_end,
+	.map_start = mp_map_start,
+	.map_key = mp_map_key,
+	.map_end = mp_map_end,
+	.string = mp_string,
+	.integer = mp_int,
+	.song = mp_song,
+};
@@ -0,0 +1,208 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#include "common.h"
+#include "pool.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdlib.h>
+
+// the queue is a ring of slots, each with a sequence number saying
+// whose turn it is: a slot is free for the push at pos when its
+// sequence is pos, and holds a job for the pop at pos when it is
+// pos + 1.  Pushes and pops claim their position with a CAS, so
+// neither side ever takes a lock.  The semaphores count the jobs and
+// the free slots, so that threads sleep rather than spin when there
+// is nothing to do (or no room to do it).
+struct slot {
+	uint64_t seq;
+	void *job;
+};
+
+struct pool {
+	struct slot *slots;
+	uint64_t mask;
+	// the next positions to push to and pop from, on cache lines of
+	// their own so that the producer and the workers don't fight
+	// over them.
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+	// jobs done, and how many pool_drain is waiting for
+	uint64_t done __attribute__((aligned(64)));
+	uint64_t drain_at;
+	// jobs pushed, only touched by the producer
+	uint64_t pushed;
+	sem_t jobs;
+	sem_t room;
+	sem_t drained;
+
+	pool_fn fn;
+	void *data;
+	int nthreads;
+	pthread_t *threads;
+};
+
+// a job that tells the thread which pops it to exit
+static char STOP;
+
+static void
+sem_wait_all(sem_t *sem)
+{
+	while (sem_wait(sem)) {
+		if (errno != EINTR)
+			exit_perr("sem_wait");
+	}
+}
+
+static void
+push(struct pool *self, void *job)
+{
+	struct slot *slot;
+	uint64_t pos, seq;
+
+	sem_wait_all(&self->room);
+	pos = __atomic_load_n(&self->head, __ATOMIC_RELAXED);
+	while (true) {
+		slot = &self->slots[pos & self->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(
+				    &self->head, &pos, pos + 1, true,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (seq < pos) {
+			// the last worker to have this slot hasn't
+			// finished taking its job out yet.
+			sched_yield();
+			pos = __atomic_load_n(&self->head, __ATOMIC_RELAXED);
+		} else {
+			pos = __atomic_load_n(&self->head, __ATOMIC_RELAXED);
+		}
+	}
+	slot->job = job;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	sem_post(&self->jobs);
+}
+
+static void *
+pop(struct pool *self)
+{
+	struct slot *slot;
+	uint64_t pos, seq;
+	void *job;
+
+	sem_wait_all(&self->jobs);
+	pos = __atomic_load_n(&self->tail, __ATOMIC_RELAXED);
+	while (true) {
+		slot = &self->slots[pos & self->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos + 1) {
+			if (__atomic_compare_exchange_n(
+				    &self->tail, &pos, pos + 1, true,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (seq < pos + 1) {
+			// claimed by a push that hasn't stored its job
+			sched_yield();
+			pos = __atomic_load_n(&self->tail, __ATOMIC_RELAXED);
+		} else {
+			pos = __atomic_load_n(&self->tail, __ATOMIC_RELAXED);
+		}
+	}
+	job = slot->job;
+	__atomic_store_n(&slot->seq, pos + self->mask + 1, __ATOMIC_RELEASE);
+	sem_post(&self->room);
+
+	return job;
+}
+
+static void *
+pool_routine(struct pool *self)
+{
+	void *job;
+	uint64_t done;
+
+	while ((job = pop(self)) != &STOP) {
+		self->fn(self->data, job);
+
+		// wake pool_drain if this was the job it was waiting
+		// for.  It may already have seen that it was done and
+		// not be waiting, which leaves a post it will ignore.
+		done = __atomic_add_fetch(&self->done, 1, __ATOMIC_SEQ_CST);
+		if (done == __atomic_load_n(&self->drain_at, __ATOMIC_SEQ_CST))
+			sem_post(&self->drained);
+	}
+
+	return NULL;
+}
+
+struct pool *
+pool_new(int nthreads, int len, pool_fn fn, void *data)
+{
+	struct pool *self;
+	int err;
+
+	if (len <= 0 || len & (len - 1))
+		exit_msg("%s: len %d isn't a power of two", __func__, len);
+
+	self = xcalloc(sizeof(*self));
+	self->slots = xcalloc(len * sizeof(*self->slots));
+	self->mask = len - 1;
+	for (int i = 0; i < len; i++)
+		self->slots[i].seq = i;
+	sem_init(&self->jobs, 0, 0);
+	sem_init(&self->room, 0, len);
+	sem_init(&self->drained, 0, 0);
+	self->fn = fn;
+	self->data = data;
+
+	self->nthreads = nthreads;
+	self->threads = xcalloc(nthreads * sizeof(*self->threads));
+	for (int i = 0; i < nthreads; i++) {
+		err = pthread_create(&self->threads[i], NULL,
+				     (pthread_routine)pool_routine, self);
+		if (err)
+			exit_msg("%s: pthread_create: %d", __func__, err);
+	}
+
+	return self;
+}
+
+void
+pool_free(struct pool *self)
+{
+	// every job before the STOPs is done first
+	for (int i = 0; i < self->nthreads; i++)
+		push(self, &STOP);
+	for (int i = 0; i < self->nthreads; i++)
+		pthread_join(self->threads[i], NULL);
+
+	sem_destroy(&self->jobs);
+	sem_destroy(&self->room);
+	sem_destroy(&self->drained);
+	free(self->threads);
+	free(self->slots);
+	free(self);
+}
+
+void
+pool_push(struct pool *self, void *job)
+{
+	self->pushed++;
+	push(self, job);
+}
+
+void
+pool_drain(struct pool *self)
+{
+	uint64_t want;
+
+	want = self->pushed;
+	__atomic_store_n(&self->drain_at, want, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&self->done, __ATOMIC_SEQ_CST) < want)
+		sem_wait_all(&self->drained);
+}
@@ -0,0 +1,26 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#ifndef _POOL_H_
+#define _POOL_H_
+
+// called on one of the pool's threads for each job pushed, with the
+// data the pool was created with.
+typedef void (*pool_fn)(void *data, void *job);
+
+struct pool;
+
+// starts nthreads threads running fn on jobs, which are handed to
+// them through a lock-free queue with room for len (a power of two)
+// of them.
+struct pool *pool_new(int nthreads, int len, pool_fn fn, void *data);
+// waits for every job to be done, and stops the threads.
+void pool_free(struct pool *self);
+
+// queues job, waiting for room if the queue is full.  Only one
+// thread may push jobs (or drain the pool).
+void pool_push(struct pool *self, void *job);
+// waits until every job pushed so far has been done.
+void pool_drain(struct pool *self);
+
+#endif // _POOL_H_
@@ -3,226 +3,893 @@
 // license that can be found in the LICENSE file.
 #include "queries.h"
 #include "common.h"
-#include "utils.h"
-#include "list.h"
+#include "arena.h"
+#include "cache.h"
+#include "catalog.h"
+#include "columns.h"
+#include "compress.h"
 #include "db.h"
+#include "stream.h"
+#include "utils.h"
+#include "format.h"
+#include "metrics.h"
+#include "trace.h"
 
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
-#include <glib.h>
-
-#define ALLOWED_CHARS " \t\r\n'/{}[]()!,*&#:"
+#include <event2/buffer.h>
+#include <event2/http.h>
 
-static char *query_list(sqlite3 *conn, const char *query_fmt);
-static char *song_query(sqlite3 *conn, const char *query_fmt, const char *name);
+#include <glib.h>
 
-static char *artist_list(struct req *self);
-static char *artist_query(struct req *self, const char *artist);
-static char *album_list(struct req *self);
-static char *album_query(struct req *self, const char *artist);
+// the most results a search returns, unless the client asks for a
+// different limit.
+#define SEARCH_LIMIT 100
+
+// how many artists and albums a completion returns, unless the
+// client asks for more (up to COMPLETE_MAX).
+#define COMPLETE_LIMIT 10
+#define COMPLETE_MAX 100
+
+// ranks the matches in the full-text index over music (see db.c), and
+// only then looks up the page of songs we are going to return.
+static const char SEARCH_QUERY[] =
+	"SELECT m.title, m.artist, m.album, m.track, m.path, m.time"
+	"    FROM (SELECT rowid, rank FROM music_fts"
+	"          WHERE music_fts MATCH ? ORDER BY rank LIMIT ? OFFSET ?) AS f"
+	"    JOIN music AS m ON m.id = f.rowid"
+	"    ORDER BY f.rank";
+
+static struct response *query_list(struct req *self, struct catalog *catalog,
+				   uint64_t generation, struct resp_cache *cache,
+				   struct cat_group **groups, int len, bool ids);
+static struct response *song_query(struct req *self, struct catalog *catalog,
+				   struct cat_group *group);
+
+static struct response *artist_list(struct req *self);
+static struct response *artist_query(struct req *self, const char *artist);
+static struct response *artist_list_ids(struct req *self);
+static struct response *artist_query_id(struct req *self, int64_t id);
+static struct response *album_list(struct req *self);
+static struct response *album_query(struct req *self, const char *artist);
+static struct response *album_list_ids(struct req *self);
+static struct response *album_query_id(struct req *self, int64_t id);
+static struct response *search_list(struct req *self);
+static struct response *search_query(struct req *self, const char *terms);
+static struct response *complete_list(struct req *self);
+static struct response *complete_query(struct req *self, const char *prefix);
 
 struct ops artist_ops = {
 	.list = artist_list,
 	.query = artist_query,
+	.list_ids = artist_list_ids,
+	.query_id = artist_query_id,
 };
 
 struct ops album_ops = {
 	.list = album_list,
 	.query = album_query,
+	.list_ids = album_list_ids,
+	.query_id = album_query_id,
+};
+
+struct ops search_ops = {
+	.list = search_list,
+	.query = search_query,
+};
+
+struct ops complete_ops = {
+	.list = complete_list,
+	.query = complete_query,
 };
 
-struct json_ops json_ops = {
-	.length = info_length,
-	.jsonify = info_jsonify,
+// results with more rows than this are streamed to the client a
+// chunk at a time, rather than built (and cached) whole.  0 means
+// never stream.
+int stream_rows = 10000;
+
+// a run of rows from a catalog snapshot: either groups or songs,
+// whichever isn't NULL.  Groups are written as their names, or with
+// ids as well as maps of their id, name, tracks and time.
+struct rows {
+	struct cat_group **groups;
+	struct cat_song **songs;
+	int len;
+	bool ids;
 };
 
-static struct info *
-info_song_new(const char *title, const char *artist, const char *album,
-	      const char *track, const char *path)
+// rows being streamed.  holds a reference to the catalog, which
+// keeps the rows alive for as long as the client takes to read them.
+struct row_stream {
+	struct catalog *catalog;
+	struct rows rows;
+	int next;
+	const struct format_ops *fmt;
+	// whether the list has been started, and what list_start said
+	bool started;
+	size_t mark;
+	// songs laid out a column at a time are written from here
+	// instead.
+	enum RESP_LAYOUT layout;
+	struct columns columns;
+	// each chunk is written here, and then copied to the client
+	struct wbuf out;
+};
+
+// about how long a song, a name and a name with its id are once
+// written, to size buffers up front.
+#define SONG_LEN (192)
+#define CAT_NAME_LEN (24)
+#define CAT_ID_LEN (64)
+
+static size_t
+row_len(const struct rows *rows)
 {
-	// in 1 allocation get both info and song, one after another.
-	struct info *ret = xcalloc(sizeof(struct info) + sizeof(struct song));
-	struct song *song = (struct song *)&ret[1];
+	if (rows->songs)
+		return SONG_LEN;
+	return rows->ids ? CAT_ID_LEN : CAT_NAME_LEN;
+}
 
-	ret->ops = &json_ops;
-	ret->type = SONG;
-	ret->data.song = song;
+static void
+group_write(const struct format_ops *fmt, struct wbuf *out,
+	    const struct cat_group *group)
+{
+	fmt->map_start(out, 4);
+	fmt->map_key(out, 0, "id");
+	fmt->integer(out, group->id);
+	fmt->map_key(out, 1, "name");
+	fmt->string(out, group->name);
+	fmt->map_key(out, 2, "tracks");
+	fmt->integer(out, group->len);
+	fmt->map_key(out, 3, "time");
+	fmt->integer(out, group->time);
+	fmt->map_end(out);
+}
 
-	song->title = g_uri_escape_string(title, ALLOWED_CHARS, true);
-	song->artist = g_uri_escape_string(artist, ALLOWED_CHARS, true);
-	song->album = g_uri_escape_string(album, ALLOWED_CHARS, true);
-	song->track = g_uri_escape_string(track, ALLOWED_CHARS, true);
-	song->path = g_uri_escape_string(path, ALLOWED_CHARS, true);
+// appends row i of rows.
+static void
+row_write(const struct format_ops *fmt, struct wbuf *out,
+	  const struct rows *rows, int i)
+{
+	const struct cat_song *song;
+	struct song_row row;
+
+	if (!rows->songs) {
+		if (rows->ids)
+			group_write(fmt, out, rows->groups[i]);
+		else
+			fmt->string(out, rows->groups[i]->name);
+		return;
+	}
 
-	return ret;
+	song = rows->songs[i];
+	row.title = song->title;
+	row.artist = song->artist;
+	row.album = song->album;
+	row.path = song->path;
+	row.track = song->track;
+	row.time = song->time;
+	fmt->song(out, &row);
+}
+
+// stream_fill for row_streams
+static bool
+rows_fill(struct row_stream *self, struct evbuffer *buf, size_t min)
+{
+	struct wbuf *out;
+	size_t have;
+	bool more;
+
+	out = &self->out;
+	out->len = 0;
+	have = evbuffer_get_length(buf);
+
+	if (self->layout == LAYOUT_COLUMNS) {
+		more = columns_write(&self->columns, out,
+				     have < min ? min - have : 0);
+		evbuffer_add(buf, out->buf, out->len);
+		return more;
+	}
+
+	// the length is known up front, so the list's start and end
+	// can go in different chunks.
+	if (!self->started) {
+		self->mark = self->fmt->list_start(out, self->rows.len);
+		self->started = true;
+	}
+	while (self->next < self->rows.len && have + out->len < min) {
+		self->fmt->list_item(out, self->next);
+		row_write(self->fmt, out, &self->rows, self->next);
+		self->next++;
+	}
+	if (self->next == self->rows.len)
+		self->fmt->list_end(out, self->mark, self->rows.len);
+
+	evbuffer_add(buf, out->buf, out->len);
+
+	return self->next < self->rows.len;
 }
 
+static void
+rows_free(struct row_stream *self)
+{
+	catalog_release(self->catalog);
+	if (self->layout == LAYOUT_COLUMNS)
+		columns_free(&self->columns);
+	wbuf_free(&self->out);
+	free(self);
+}
 
-static struct info *
-info_string_new(const char *name)
+// starts streaming rows to the client, if there are enough of them
+// to be worth it.  returns true if it did.
+static bool
+rows_stream(struct req *self, struct catalog *catalog,
+	    const struct rows *rows)
 {
-	// in 1 allocation get both info and song, one after another.
-	struct info *ret = xcalloc(sizeof(struct info));
+	struct row_stream *stream;
+
+	if (stream_rows <= 0 || rows->len <= stream_rows)
+		return false;
+
+	stream = xcalloc(sizeof(*stream));
+	catalog_ref(catalog);
+	stream->catalog = catalog;
+	stream->rows = *rows;
+	stream->fmt = formats[self->kind];
+	stream->layout = self->layout;
+	if (self->layout == LAYOUT_COLUMNS)
+		columns_init(&stream->columns, stream->fmt, rows->songs,
+			     rows->len);
+	wbuf_init(&stream->out, 0);
+
+	self->streamed = true;
+	trace_header(&self->trace, self->req);
+	stream_start(self->req, self->encoding, (stream_fill)rows_fill,
+		     (stream_free)rows_free, stream);
+	trace_phase(&self->trace, "stream");
+	return true;
+}
 
-	ret->ops = &json_ops;
-	ret->type = STRING;
-	ret->data.name = g_uri_escape_string(name, ALLOWED_CHARS, true);
+// returns resp in the encoding the client asked for, compressing it
+// the first time a version of resp is asked for in that encoding.
+// consumes the caller's reference to resp.
+static struct response *
+encode(struct req *self, struct resp_cache *cache, struct response *resp)
+{
+	struct response *ret;
 
-	return ret;
+	if (self->encoding == ENC_IDENTITY)
+		return resp;
+
+	ret = response_compress(resp, self->encoding);
+	response_unref(resp);
+	trace_phase(&self->trace, "compress");
+
+	return resp_cache_set(cache, self->kind, self->layout, self->encoding,
+			      ret);
+}
+
+
+// returns the response for a finished body.
+static struct response *
+body_finish(struct req *self, struct wbuf *out)
+{
+	char *result;
+
+	result = wbuf_release(out);
+	trace_phase(&self->trace, "serialize");
+
+	return response_new(result, out->len, ENC_IDENTITY);
 }
 
+
+// appends len songs, laid out a column at a time.
 static void
-info_free(struct info *self)
+columns_body(const struct format_ops *fmt, struct wbuf *out,
+	     struct cat_song *const *songs, int len)
 {
-	if (unlikely(self->type == INVALID)) {
-		log(ERROR, "invalid type");
-		return;
+	struct columns columns;
+
+	columns_init(&columns, fmt, songs, len);
+	columns_write(&columns, out, SIZE_MAX);
+	columns_free(&columns);
+}
+
+
+// builds the response for rows, in the format and layout the client
+// asked for.
+static struct response *
+rows_body(struct req *self, const struct rows *rows)
+{
+	const struct format_ops *fmt;
+	struct wbuf out;
+	size_t mark;
+
+	fmt = formats[self->kind];
+	wbuf_init(&out, rows->len * row_len(rows));
+	if (self->layout == LAYOUT_COLUMNS) {
+		columns_body(fmt, &out, rows->songs, rows->len);
+		return body_finish(self, &out);
 	}
 
-	if (self->type == STRING) {
-		free(self->data.name);
-		free(self);
-		return;
+	mark = fmt->list_start(&out, rows->len);
+	for (int i = 0; i < rows->len; i++) {
+		fmt->list_item(&out, i);
+		row_write(fmt, &out, rows, i);
 	}
+	fmt->list_end(&out, mark, rows->len);
 
-	free(self->data.song->title);
-	free(self->data.song->artist);
-	free(self->data.song->album);
-	free(self->data.song->track);
-	free(self->data.song->path);
-	free(self);
+	return body_finish(self, &out);
 }
 
 
+// returns the response for all of an object's rows, either from its
+// cache or by building (and caching) it.
+static struct response *
+cached_response(struct req *self, struct catalog *catalog,
+		struct resp_cache *cache, const struct rows *rows)
+{
+	struct response *ret;
+
+	ret = resp_cache_get(cache, self->kind, self->layout, self->encoding);
+	if (ret) {
+		trace_phase(&self->trace, "cache");
+		return ret;
+	}
+
+	// too big to keep around
+	if (rows_stream(self, catalog, rows))
+		return NULL;
+
+	ret = resp_cache_get(cache, self->kind, self->layout, ENC_IDENTITY);
+	if (!ret)
+		ret = resp_cache_set(cache, self->kind, self->layout,
+				     ENC_IDENTITY, rows_body(self, rows));
+
+	return encode(self, cache, ret);
+}
+
+
+// returns a response that won't be cached in the encoding the client
+// asked for.  consumes the caller's reference to resp.
+static struct response *
+encode_uncached(struct req *self, struct response *resp)
+{
+	struct response *ret;
+
+	if (self->encoding == ENC_IDENTITY)
+		return resp;
+
+	ret = response_compress(resp, self->encoding);
+	response_unref(resp);
+	trace_phase(&self->trace, "compress");
+	return ret;
+}
+
+
+// returns the response for a page of rows, which isn't cached.
+static struct response *
+page_response(struct req *self, struct catalog *catalog,
+	      const struct rows *rows)
+{
+	if (rows_stream(self, catalog, rows))
+		return NULL;
+
+	return encode_uncached(self, rows_body(self, rows));
+}
+
+
+// narrows rows to the page the client asked for, where skip is
+// the number of rows the after= key says to skip.
+static void
+page_apply(struct req *self, struct rows *rows, int skip)
+{
+	struct page *page;
+	char total[12];
+	int start;
+
+	page = &self->page;
+
+	snprintf(total, sizeof(total), "%d", rows->len);
+	evhttp_add_header(evhttp_request_get_output_headers(self->req),
+			  "X-Total-Count", total);
+
+	start = skip;
+	if (page->offset > rows->len - start)
+		start = rows->len;
+	else
+		start += page->offset;
+
+	if (rows->groups)
+		rows->groups += start;
+	else
+		rows->songs += start;
+	rows->len -= start;
+
+	if (page->limit >= 0 && rows->len > page->limit)
+		rows->len = page->limit;
+}
+
+
+// pages through a sorted list of names.  after= is a name, and the
+// page starts with the first name that sorts after it, whether or
+// not it is still in the list.
 static void
-info_list_destroy(struct list_head *head)
+names_page(struct req *self, struct rows *rows)
 {
-	struct list_head *curr, *next;
-	for (curr = head->next; curr != head;) {
-		next = curr->next;
-		// get next pointer now since we're freeing the memory
-		__list_del(curr->prev, curr->next);
-		info_free(to_info(curr));
-		curr = next;
+	int skip;
+
+	skip = 0;
+	if (self->page.after)
+		skip = catalog_after(rows->groups, rows->len, self->page.after);
+
+	page_apply(self, rows, skip);
+}
+
+
+// pages through the songs of an artist or album.  after= is the path
+// of the last song the client has.  If that song has since gone,
+// there is no telling where it was, so the page is empty.
+static void
+songs_page(struct req *self, struct rows *rows)
+{
+	int skip;
+
+	skip = 0;
+	if (self->page.after) {
+		skip = rows->len;
+		for (int i = 0; i < rows->len; i++) {
+			if (strcmp(rows->songs[i]->path, self->page.after) == 0) {
+				skip = i + 1;
+				break;
+			}
+		}
 	}
+
+	page_apply(self, rows, skip);
 }
 
 
-static char *
+static struct response *
 artist_list(struct req *self)
 {
-	return query_list(
-		self->db,
-		"SELECT DISTINCT artist FROM music");
+	struct catalog *catalog;
+	struct response *result;
+
+	catalog = catalog_acquire();
+	result = query_list(self, catalog, catalog->artists_generation,
+			    &catalog->artists_cache, catalog->artists,
+			    catalog->nartists, false);
+	catalog_release(catalog);
+
+	return result;
 }
 
 
-static char *
+static struct response *
 artist_query(struct req *self, const char *artist)
 {
-	// FIXME: should remove the ORDER BY and do it client side.
-	static const char *query_fmt =
-		"SELECT title, artist, album, track, path"
-		"    FROM music WHERE artist = ?"
-		"    ORDER BY album, track, title";
+	struct catalog *catalog;
+	struct response *result;
 
-	return song_query(self->db, query_fmt, artist);
+	catalog = catalog_acquire();
+	result = song_query(self, catalog,
+			    catalog_find(catalog->artists, catalog->nartists,
+					 artist));
+	catalog_release(catalog);
+
+	return result;
 }
 
 
-static char *
+// the sizes of groups change along with any of their songs, so
+// these lists change with every version of the catalog.
+static struct response *
+artist_list_ids(struct req *self)
+{
+	struct catalog *catalog;
+	struct response *result;
+
+	catalog = catalog_acquire();
+	result = query_list(self, catalog, catalog->generation,
+			    &catalog->artist_ids_cache, catalog->artists,
+			    catalog->nartists, true);
+	catalog_release(catalog);
+
+	return result;
+}
+
+
+static struct response *
+artist_query_id(struct req *self, int64_t id)
+{
+	struct catalog *catalog;
+	struct response *result;
+
+	catalog = catalog_acquire();
+	result = song_query(self, catalog,
+			    catalog_find_id(catalog->artists_by_id,
+					    catalog->nartists, id));
+	catalog_release(catalog);
+
+	return result;
+}
+
+
+static struct response *
 album_list(struct req *self)
 {
-	return query_list(
-		self->db,
-		"SELECT DISTINCT album FROM music");
+	struct catalog *catalog;
+	struct response *result;
+
+	catalog = catalog_acquire();
+	result = query_list(self, catalog, catalog->albums_generation,
+			    &catalog->albums_cache, catalog->albums,
+			    catalog->nalbums, false);
+	catalog_release(catalog);
+
+	return result;
 }
 
 
-static char *
+static struct response *
 album_query(struct req *self, const char *album)
 {
-	// FIXME: should remove the ORDER BY and do it client side.
-	static const char *query_fmt =
-		"SELECT title, artist, album, track, path"
-		"    FROM music WHERE album = ?"
-		"    ORDER BY album, track, artist, title";
-	return song_query(self->db, query_fmt, album);
+	struct catalog *catalog;
+	struct response *result;
+
+	catalog = catalog_acquire();
+	result = song_query(self, catalog,
+			    catalog_find(catalog->albums, catalog->nalbums,
+					 album));
+	catalog_release(catalog);
+
+	return result;
 }
 
-// returns a string containing a JSON representation of the data
-// returned by the particular query passed in.  In this case, its
-// always a (JSON) list of (quoted) strings.  Its used by both the
-// artist_list and album_list functions.
-static char *
-query_list(sqlite3 *db, const char *query_fmt)
+static struct response *
+album_list_ids(struct req *self)
 {
-	int len, err;
-	char *result;
-	sqlite3_stmt *stmt;
+	struct catalog *catalog;
+	struct response *result;
+
+	catalog = catalog_acquire();
+	result = query_list(self, catalog, catalog->generation,
+			    &catalog->album_ids_cache, catalog->albums,
+			    catalog->nalbums, true);
+	catalog_release(catalog);
 
-	LIST_HEAD(list);
-	PREPARE_QUERY(db, query_fmt, &stmt);
+	return result;
+}
 
-	while (sqlite3_step(stmt) == SQLITE_ROW) {
-		struct info *row;
-		const char *val;
 
-		// we don't care about the unsigned qualifier
-		val = (const char *)sqlite3_column_text(stmt, 0);
-		if (strlen(val) == 0)
-			continue;
-		row = info_string_new(val);
-		list_add(&list, &row->list);
+static struct response *
+album_query_id(struct req *self, int64_t id)
+{
+	struct catalog *catalog;
+	struct response *result;
+
+	catalog = catalog_acquire();
+	result = song_query(self, catalog,
+			    catalog_find_id(catalog->albums_by_id,
+					    catalog->nalbums, id));
+	catalog_release(catalog);
+
+	return result;
+}
+
+// returns a representation of the names of the given catalog
+// groups: a list of strings, or with ids, of maps.  Its used by both
+// the artist_list and album_list functions (and their _ids versions),
+// and is only generated once per version of the list.
+static struct response *
+query_list(struct req *self, struct catalog *catalog, uint64_t generation,
+	   struct resp_cache *cache, struct cat_group **groups, int len,
+	   bool ids)
+{
+	struct rows rows;
+
+	// a list of names is the same whichever layout was asked for.
+	self->layout = LAYOUT_ROWS;
+	if (etag_match(self->req, self->kind, self->layout, generation))
+		return NULL;
+	trace_phase(&self->trace, "lookup");
+
+	rows.groups = groups;
+	rows.songs = NULL;
+	rows.len = len;
+	rows.ids = ids;
+
+	if (self->page.paged) {
+		names_page(self, &rows);
+		return page_response(self, catalog, &rows);
 	}
 
-	// the +1 is for the trailing null byte.
-	len = list_length(&list) + 1;
-	result = xcalloc(len);
-	list_jsonify(&list, result);
+	return cached_response(self, catalog, cache, &rows);
+}
 
-	info_list_destroy(&list);
 
-	sqlite3_finalize(stmt);
+// returns a list of the songs in group, which is already in
+// the order we want to return them.  A NULL group (an artist or album
+// we've never heard of) is an empty list.  Responses are cached on
+// the group, which is replaced when any of its songs change.
+static struct response *
+song_query(struct req *self, struct catalog *catalog, struct cat_group *group)
+{
+	struct rows rows;
+
+	// an unknown name stays empty until the catalog changes.
+	if (etag_match(self->req, self->kind, self->layout,
+		       group ? group->generation : catalog->generation))
+		return NULL;
+	trace_phase(&self->trace, "lookup");
+
+	rows.groups = NULL;
+	rows.songs = group ? group->songs : NULL;
+	rows.len = group ? group->len : 0;
+	rows.ids = false;
+
+	// an unknown name is a tiny response, not worth caching.
+	if (!group)
+		return page_response(self, catalog, &rows);
+
+	if (self->page.paged) {
+		songs_page(self, &rows);
+		return page_response(self, catalog, &rows);
+	}
 
-	return result;
+	return cached_response(self, catalog, &group->cache, &rows);
 }
 
 
+// turns what the user typed into an FTS5 query for songs with every
+// word in it, where each word may be the start of a longer one (so
+// results show up while a word is still being typed).  Words are
+// quoted, so nothing the user types is taken as FTS5 syntax.  The
+// query is allocated from arena.
 static char *
-song_query(sqlite3 *db, const char *query_fmt, const char *name)
+search_match(struct arena *arena, const char *terms)
 {
-	int len, err;
-	char *result;
+	char *ret, *p;
+	bool in_word;
+
+	// at worst every character is a quote, and every other one
+	// starts a word: '"x"* ' for each.
+	ret = arena_alloc(arena, 4 * strlen(terms) + 4);
+	p = ret;
+	in_word = false;
+
+	for (const char *s = terms; *s; s++) {
+		if (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r') {
+			if (in_word) {
+				p = stpcpy(p, "\"* ");
+				in_word = false;
+			}
+			continue;
+		}
+		if (!in_word) {
+			*p++ = '"';
+			in_word = true;
+		}
+		if (*s == '"')
+			*p++ = '"';
+		*p++ = *s;
+	}
+	if (in_word)
+		p = stpcpy(p, "\"*");
+	*p = '\0';
+
+	return ret;
+}
+
+
+// copies row into a song allocated from arena, for results that
+// have to be gathered before they can be written.
+static struct cat_song *
+song_copy(struct arena *arena, const struct song_row *row)
+{
+	struct cat_song *ret;
+
+	ret = arena_calloc(arena, sizeof(*ret));
+	ret->track = row->track;
+	ret->time = row->time;
+	ret->path = arena_strdup(arena, row->path);
+	ret->title = arena_strdup(arena, row->title);
+	ret->artist = arena_strdup(arena, row->artist);
+	ret->album = arena_strdup(arena, row->album);
+
+	return ret;
+}
+
+
+static const char *
+column_text(sqlite3_stmt *stmt, int col)
+{
+	const unsigned char *ret;
+
+	ret = sqlite3_column_text(stmt, col);
+	return ret ? (const char *)ret : "";
+}
+
+
+// returns the songs best matching terms, in the same shape as the
+// songs for an artist or album.  Search results come straight from
+// sqlite, so they aren't cached.
+static struct response *
+search(struct req *self, const char *terms)
+{
+	const struct format_ops *fmt;
+	struct song_row row;
+	struct wbuf out;
 	sqlite3_stmt *stmt;
+	GPtrArray *songs;
+	uint64_t start;
+	size_t mark;
+	char *match;
+	int err, n;
+
+	// we don't know how many rows there are until we have them all.
+	// Rows are written as they come, but columns have to wait for
+	// every song.
+	fmt = formats[self->kind];
+	wbuf_init(&out, SEARCH_LIMIT * SONG_LEN);
+	songs = NULL;
+	mark = 0;
+	if (self->layout == LAYOUT_COLUMNS)
+		songs = g_ptr_array_new();
+	else
+		mark = fmt->list_start(&out, -1);
+	n = 0;
+
+	match = search_match(self->arena, terms ? terms : "");
+	if (!*match)
+		goto out;
+
+	stmt = stmt_cache_get(self->stmts, QUERY_SEARCH, SEARCH_QUERY);
+	if (!stmt)
+		goto fail;
+
+	sqlite3_bind_text(stmt, 1, match, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 2, self->page.limit >= 0 ?
+			 self->page.limit : SEARCH_LIMIT);
+	sqlite3_bind_int(stmt, 3, self->page.offset);
+
+	start = metrics_now();
+	for (; (err = sqlite3_step(stmt)) == SQLITE_ROW; n++) {
+		row.title = column_text(stmt, 0);
+		row.artist = column_text(stmt, 1);
+		row.album = column_text(stmt, 2);
+		row.track = sqlite3_column_int(stmt, 3);
+		row.path = column_text(stmt, 4);
+		row.time = sqlite3_column_int(stmt, 5);
+		if (songs) {
+			g_ptr_array_add(songs, song_copy(self->arena, &row));
+			continue;
+		}
+		fmt->list_item(&out, n);
+		fmt->song(&out, &row);
+	}
+	metrics_stmt(STMT_SEARCH, start);
+	if (err != SQLITE_DONE) {
+		logf(ERROR, "step: %s", sqlite3_errmsg(self->stmts->db));
+		stmt_cache_put(stmt);
+		goto fail;
+	}
+
+	stmt_cache_put(stmt);
+out:
+	if (songs) {
+		columns_body(fmt, &out, (struct cat_song **)songs->pdata, n);
+		g_ptr_array_free(songs, true);
+	} else {
+		fmt->list_end(&out, mark, n);
+	}
+	trace_phase(&self->trace, "query");
+	return encode_uncached(self, body_finish(self, &out));
+fail:
+	// a partial list would look like the whole of it.
+	if (songs)
+		g_ptr_array_free(songs, true);
+	wbuf_free(&out);
+	self->failed = true;
+	return NULL;
+}
+
+
+// '/search?q=terms'
+static struct response *
+search_list(struct req *self)
+{
+	return search(self, self->terms);
+}
+
+
+// '/search/terms'
+static struct response *
+search_query(struct req *self, const char *terms)
+{
+	return search(self, terms);
+}
 
-	LIST_HEAD(list);
-	PREPARE_QUERY(db, query_fmt, &stmt);
 
-	sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+// appends a list of the names in index starting with prefix.  A NULL
+// prefix is an empty list.
+static void
+complete_names(const struct format_ops *fmt, struct wbuf *out,
+	       struct name_index *index, const char *prefix, int limit)
+{
+	const char *names[COMPLETE_MAX];
+	size_t mark;
+	int n;
+
+	n = prefix ? name_index_complete(index, prefix, names, limit) : 0;
+	mark = fmt->list_start(out, n);
+	for (int i = 0; i < n; i++) {
+		fmt->list_item(out, i);
+		fmt->string(out, names[i]);
+	}
+	fmt->list_end(out, mark, n);
+}
 
-	while (sqlite3_step(stmt) == SQLITE_ROW) {
-		struct info *row;
-		const char *title, *artist, *album, *track, *path;
 
-		// we don't care about the unsigned qualifier
-		title = (const char *)sqlite3_column_text(stmt, 0);
-		artist = (const char *)sqlite3_column_text(stmt, 1);
-		album = (const char *)sqlite3_column_text(stmt, 2);
-		track = (const char *)sqlite3_column_text(stmt, 3);
-		path = (const char *)sqlite3_column_text(stmt, 4);
-		row = info_song_new(title, artist, album, track, path);
-		list_add(&list, &row->list);
+// returns '{"artists":[...],"albums":[...]}', the first artist and
+// album names (ignoring case) starting with prefix.  Answered from
+// the catalog's name indexes, without going near sqlite.
+static struct response *
+complete(struct req *self, const char *prefix)
+{
+	const struct format_ops *fmt;
+	struct catalog *catalog;
+	struct wbuf out;
+	uint64_t generation;
+	int limit;
+
+	limit = self->page.limit;
+	if (limit < 0)
+		limit = COMPLETE_LIMIT;
+	if (limit > COMPLETE_MAX)
+		limit = COMPLETE_MAX;
+	if (!prefix || !g_utf8_validate(prefix, -1, NULL))
+		prefix = NULL;
+
+	catalog = catalog_acquire();
+
+	// completions only change when an artist or album comes or goes.
+	generation = catalog->artists_generation;
+	if (catalog->albums_generation > generation)
+		generation = catalog->albums_generation;
+	if (etag_match(self->req, self->kind, LAYOUT_ROWS, generation)) {
+		catalog_release(catalog);
+		return NULL;
 	}
 
-	// the +1 is for the trailing null byte.
-	len = list_length(&list) + 1;
-	result = xcalloc(len);
-	list_jsonify(&list, result);
+	fmt = formats[self->kind];
+	wbuf_init(&out, 2 * limit * CAT_NAME_LEN);
+	fmt->map_start(&out, 2);
+	fmt->map_key(&out, 0, "artists");
+	complete_names(fmt, &out, catalog->artist_names, prefix, limit);
+	fmt->map_key(&out, 1, "albums");
+	complete_names(fmt, &out, catalog->album_names, prefix, limit);
+	fmt->map_end(&out);
+	catalog_release(catalog);
+
+	return encode_uncached(self, body_finish(self, &out));
+}
 
-	info_list_destroy(&list);
 
-	sqlite3_finalize(stmt);
+// '/complete?prefix=typed'
+static struct response *
+complete_list(struct req *self)
+{
+	return complete(self, self->prefix);
+}
 
-	return result;
+
+// '/complete/typed'
+static struct response *
+complete_query(struct req *self, const char *prefix)
+{
+	return complete(self, prefix);
 }
@@ -7,5 +7,10 @@
 struct ops;
 extern struct ops artist_ops;
 extern struct ops album_ops;
+extern struct ops search_ops;
+extern struct ops complete_ops;
+
+// results with more rows than this are streamed, 0 disables.
+extern int stream_rows;
 
 #endif // _QUERIES_H_
@@ -0,0 +1,119 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#include "common.h"
+#include "stream.h"
+#include "compress.h"
+#include "metrics.h"
+#include "utils.h"
+
+#include <stdlib.h>
+
+#include <event2/buffer.h>
+#include <event2/http.h>
+
+// how much (uncompressed) body to generate per chunk
+#define STREAM_CHUNK (32 * 1024)
+
+struct stream {
+	struct evhttp_request *req;
+	struct evhttp_connection *evcon;
+	struct zstream *z;
+	struct evbuffer *raw;
+	struct evbuffer *out;
+	stream_fill fill;
+	stream_free free_data;
+	void *data;
+	// the route the stream is counted against, see metrics.h
+	enum ROUTE route;
+};
+
+static void
+stream_destroy(struct stream *self)
+{
+	evhttp_connection_set_closecb(self->evcon, NULL, NULL);
+	if (self->z)
+		zstream_free(self->z);
+	evbuffer_free(self->raw);
+	evbuffer_free(self->out);
+	self->free_data(self->data);
+	free(self);
+}
+
+// called if the connection goes away mid-stream.  libevent has
+// already detached req from it, and ending the reply frees req.
+static void
+stream_close_cb(struct evhttp_connection *evcon __unused, void *arg)
+{
+	struct stream *self = arg;
+
+	evhttp_send_reply_end(self->req);
+	stream_destroy(self);
+}
+
+// called once the last chunk has been written to the socket, to
+// generate and send the next one.
+static void
+stream_next(struct evhttp_connection *evcon __unused, void *arg)
+{
+	struct stream *self = arg;
+	bool more;
+
+	do {
+		more = self->fill(self->data, self->raw, STREAM_CHUNK);
+		if (self->z)
+			zstream_write(self->z, self->raw, !more, self->out);
+		else
+			evbuffer_add_buffer(self->out, self->raw);
+	} while (more && evbuffer_get_length(self->out) == 0);
+
+	metrics_bytes(self->route, evbuffer_get_length(self->out));
+
+	if (more) {
+		evhttp_send_reply_chunk_with_cb(self->req, self->out,
+						stream_next, self);
+		return;
+	}
+
+	evhttp_send_reply_chunk(self->req, self->out);
+	evhttp_send_reply_end(self->req);
+	stream_destroy(self);
+}
+
+void
+stream_start(struct evhttp_request *req, enum RESP_ENCODING encoding,
+	     stream_fill fill, stream_free free_data, void *data)
+{
+	struct stream *self;
+
+	if (encoding != ENC_IDENTITY)
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+				  "Content-Encoding", encoding_name(encoding));
+	evhttp_send_reply_start(req, HTTP_OK, "OK");
+
+	// libevent never calls back for the chunks of a reply without
+	// a body, so we'd wait forever.
+	if (evhttp_request_get_command(req) == EVHTTP_REQ_HEAD) {
+		evhttp_send_reply_end(req);
+		free_data(data);
+		return;
+	}
+
+	self = xcalloc(sizeof(*self));
+	self->req = req;
+	self->evcon = evhttp_request_get_connection(req);
+	if (encoding != ENC_IDENTITY)
+		self->z = zstream_new(encoding);
+	self->raw = evbuffer_new();
+	self->out = evbuffer_new();
+	if (!self->raw || !self->out)
+		exit_perr("%s: evbuffer_new", __func__);
+	self->fill = fill;
+	self->free_data = free_data;
+	self->data = data;
+	self->route = metrics_route();
+
+	evhttp_connection_set_closecb(self->evcon, stream_close_cb, self);
+
+	stream_next(self->evcon, self);
+}
@@ -0,0 +1,28 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+#include "common.h"
+
+struct evbuffer;
+struct evhttp_request;
+
+// a stream sends a response as a series of HTTP chunks, generating
+// each chunk only once the previous one has been written to the
+// socket.  However large the response, only about a chunk of it is
+// ever in memory.
+
+// adds rows to buf until it holds at least min bytes, and returns
+// false once the last row has been added.
+typedef bool (*stream_fill)(void *data, struct evbuffer *buf, size_t min);
+// releases data, once the stream is done or the client went away.
+typedef void (*stream_free)(void *data);
+
+// starts a 200 OK chunked reply to req, compressed with encoding,
+// whose body is produced by repeatedly calling fill.
+void stream_start(struct evhttp_request *req, enum RESP_ENCODING encoding,
+		  stream_fill fill, stream_free free_data, void *data);
+
+#endif // _STREAM_H_
@@ -2,9 +2,13 @@
 // Use of this source code is governed by the MIT
 // license that can be found in the LICENSE file.
 #include "common.h"
+#include "catalog.h"
+#include "metrics.h"
 #include "tags.h"
 #include "utils.h"
 #include "db.h"
+#include "pool.h"
+#include "writer.h"
 
 #include <stddef.h>
 #include <stdio.h>
@@ -16,6 +20,7 @@
 #include <netdb.h>
 #include <ftw.h>
 
+#include <pthread.h>
 #include <signal.h>
 #include <unistd.h>
 #include <getopt.h>
@@ -25,69 +30,392 @@
 
 #include <stdint.h>
 
-#include <taglib/tag_c.h>
-
-static const char INSERT_QUERY[] =
-	"INSERT INTO music (title, artist, album, track, time, modified, path)"
-	"    VALUES (?, ?, ?, ?, ?, ?, ?)";
+#include <glib.h>
 
-static const char UPDATE_QUERY[] =
-	"UPDATE music SET title = ?, artist = ?, album = ?, track = ?,"
-	"                 time = ?, modified = ?"
-	"    WHERE path = ?";
+#include <taglib/tag_c.h>
 
 static const char MODIFIED_QUERY[] =
 	"SELECT modified"
 	"    FROM music WHERE path = ?";
 
-static const char DELETE_QUERY[] =
-	"DELETE FROM music "
-	"    WHERE path = ?";;
+static const char KNOWN_QUERY[] =
+	"SELECT path, modified FROM music";
+
+static const char KNOWN_DIRS_QUERY[] =
+	"SELECT path, mtime, ctime FROM dirs";
+
+// how long the writer waits for anything else writing to the db (like
+// the sqlite3 shell) to finish.
+static const int WRITE_BUSY_TIMEOUT_MS = 5000;
 
-// so we can keep track of our db
+// how many files the tag readers can have queued up
+#define TAG_QUEUE_LEN (1024)
+
+int tag_threads;
+bool full_scan;
+
+// so we can keep track of our db.  The indexer thread only reads from
+// it, to find out what has changed.  Files that have are read by the
+// pool's threads, and the writer does the writing.
 struct db_info {
 	sqlite3 *db;
-	sqlite3_stmt *insert_query;
-	sqlite3_stmt *update_query;
 	sqlite3_stmt *modified_query;
-	sqlite3_stmt *delete_query;
+	struct pool *pool;
+	struct writer *writer;
+	// path -> struct known_song, for every song in the db at
+	// startup, until the first crawl is done.  The crawl takes out
+	// the files it finds, leaving the ones that have gone.
+	GHashTable *known;
+	// and the same for directories: path -> struct known_dir.
+	GHashTable *known_dirs;
+	// the directories the crawl found unchanged, whose songs are
+	// left in known, and the stamps of the ones it didn't.
+	GHashTable *unchanged;
+	GPtrArray *stamps;
+	// rel path -> struct tag_job, for the files queued or being read.
+	// A file is only read on one thread at a time, so that an older
+	// read can't reach the writer after a newer one.
+	pthread_mutex_t busy_lock;
+	GHashTable *busy;
+	// the directories with a file the first crawl couldn't read (a
+	// half-copied one, say), which don't get a stamp so that the
+	// next crawl tries them again.  guarded by busy_lock too.
+	GHashTable *failed_dirs;
+	// rel path -> struct pending_delete, for the songs whose deletes
+	// the writer hasn't committed yet.  modified_query can't see
+	// those, and would find the song's old row if its file came
+	// back before they were.
+	GHashTable *deleting;
+};
+
+struct known_song {
+	int64_t modified;
+	char path[];
+};
+
+struct pending_delete {
+	// the writer's number for the delete (see writer_delete)
+	uint64_t change;
+	char path[];
+};
+
+// what the dirs table says about a directory.  A directory's mtime
+// and ctime change whenever a file is added to, removed from or
+// renamed in it, so if they haven't changed, neither has the list of
+// files in it.  A file changed in place while we weren't running
+// doesn't change either; --full-scan is for finding those.
+struct known_dir {
+	int64_t mtime;
+	int64_t ctime;
+	char path[];
+};
+
+// a file for the pool to read the tags of
+struct tag_job {
+	char *full_path;
+	// the path under '$dir_name/', pointing into full_path
+	const char *rel_path;
+	// set if the file changed again after the read was queued, and
+	// has to be read once more.  guarded by busy_lock.
+	bool again;
 };
 
-#define PREPARE_QUERY(db, in, out) do {					\
-		err = sqlite3_prepare_v2(db,				\
-					 in,				\
-					 strlen(in),			\
-					 out,				\
-					 NULL);				\
-		if (err != SQLITE_OK)					\
-			exit_msg("sqlite3 prepare '%s' error: %d", in, err); \
-	} while (false)
+static void tag_routine(struct db_info *dbi, struct tag_job *job);
 
+// reads the path and modification time of every song into known in
+// one pass, so that the first crawl doesn't have to look them up one
+// at a time.
+static void
+load_known(struct db_info *dbi)
+{
+	struct known_song *known;
+	sqlite3_stmt *stmt;
+	const char *path;
+	uint64_t start;
+	size_t len;
+	int err;
+
+	dbi->known = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+					   free);
+
+	PREPARE_QUERY(dbi->db, KNOWN_QUERY, &stmt);
+	start = metrics_now();
+	while ((err = sqlite3_step(stmt)) == SQLITE_ROW) {
+		path = (const char *)sqlite3_column_text(stmt, 0);
+		len = sqlite3_column_bytes(stmt, 0);
+		known = xmalloc(sizeof(*known) + len + 1);
+		known->modified = sqlite3_column_int64(stmt, 1);
+		memcpy(known->path, path, len + 1);
+		g_hash_table_replace(dbi->known, known->path, known);
+	}
+	metrics_stmt(STMT_MODIFIED, start);
+	if (err != SQLITE_DONE)
+		exit_msg("%s: %d - %s", __func__, err,
+			 sqlite3_errmsg(dbi->db));
+	sqlite3_finalize(stmt);
+}
+
+static void
+load_known_dirs(struct db_info *dbi)
+{
+	struct known_dir *known;
+	sqlite3_stmt *stmt;
+	const char *path;
+	uint64_t start;
+	size_t len;
+	int err;
+
+	dbi->known_dirs = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+						free);
+	dbi->unchanged = g_hash_table_new_full(g_str_hash, g_str_equal, free,
+					       NULL);
+	dbi->stamps = g_ptr_array_new();
+
+	PREPARE_QUERY(dbi->db, KNOWN_DIRS_QUERY, &stmt);
+	start = metrics_now();
+	while ((err = sqlite3_step(stmt)) == SQLITE_ROW) {
+		path = (const char *)sqlite3_column_text(stmt, 0);
+		len = sqlite3_column_bytes(stmt, 0);
+		known = xmalloc(sizeof(*known) + len + 1);
+		known->mtime = sqlite3_column_int64(stmt, 1);
+		known->ctime = sqlite3_column_int64(stmt, 2);
+		memcpy(known->path, path, len + 1);
+		g_hash_table_replace(dbi->known_dirs, known->path, known);
+	}
+	metrics_stmt(STMT_DIRS, start);
+	if (err != SQLITE_DONE)
+		exit_msg("%s: %d - %s", __func__, err,
+			 sqlite3_errmsg(dbi->db));
+	sqlite3_finalize(stmt);
+}
 
-void *tags_init(sqlite3 *db)
+void *tags_init(sqlite3 *db, const char *db_path)
 {
 	int err;
 	struct db_info *ret;
 
 	ret = xcalloc(sizeof(struct db_info));
 
-	ret->db = db;
+	sqlite3_busy_timeout(db, WRITE_BUSY_TIMEOUT_MS);
+	ret->writer = writer_new(db);
+
+	// the tag readers own the strings taglib gives them, rather than
+	// taglib keeping track of them all in one (unlocked) list.
+	taglib_set_string_management_enabled(false);
+	if (tag_threads <= 0)
+		tag_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (tag_threads <= 0)
+		tag_threads = 1;
+	pthread_mutex_init(&ret->busy_lock, NULL);
+	ret->busy = g_hash_table_new(g_str_hash, g_str_equal);
+	ret->failed_dirs = g_hash_table_new_full(g_str_hash, g_str_equal,
+						 free, NULL);
+	ret->deleting = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+					      free);
+	ret->pool = pool_new(tag_threads, TAG_QUEUE_LEN, (pool_fn)tag_routine,
+			     ret);
+
+	ret->db = db_open_reader(db_path);
+	PREPARE_QUERY(ret->db, MODIFIED_QUERY, &ret->modified_query);
+	load_known(ret);
+	load_known_dirs(ret);
 
-	PREPARE_QUERY(db, INSERT_QUERY, &ret->insert_query);
-	PREPARE_QUERY(db, UPDATE_QUERY, &ret->update_query);
-	PREPARE_QUERY(db, MODIFIED_QUERY, &ret->modified_query);
-	PREPARE_QUERY(db, DELETE_QUERY, &ret->delete_query);
+	return ret;
+}
+
+// returns the directory a song's path is in, relative to the music
+// dir like the path is (so '' for the music dir itself).  malloc'd.
+static char *
+rel_dir(const char *path)
+{
+	const char *slash;
+
+	slash = strrchr(path, '/');
+	if (!slash)
+		return strdup("");
+	return strndup(path, slash - path);
+}
+
+static int64_t
+timespec_ns(const struct timespec *ts)
+{
+	return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+// a directory only needs its files looked at if it has changed since
+// the last crawl, or we haven't seen it before.
+bool
+is_dir_modified_cb(struct dirwatch *self, const char *path,
+		   const struct stat *st)
+{
+	struct db_info *dbi;
+	struct known_dir *known;
+	struct dir_stamp *stamp;
+	const char *rel_path;
+	int64_t mtime, ctime;
+	bool modified;
+
+	dbi = self->data;
 
+	// the music dir itself is ''
+	rel_path = &path[strlen(self->dir_name)];
+	if (*rel_path == '/')
+		rel_path++;
+
+	mtime = timespec_ns(&st->st_mtim);
+	ctime = timespec_ns(&st->st_ctim);
+
+	known = g_hash_table_lookup(dbi->known_dirs, rel_path);
+	modified = full_scan || !known || known->mtime != mtime ||
+		known->ctime != ctime;
+	g_hash_table_remove(dbi->known_dirs, rel_path);
+
+	if (!modified) {
+		g_hash_table_add(dbi->unchanged, strdup(rel_path));
+		metrics_indexer(IDX_DIRS_SKIPPED);
+		return false;
+	}
+
+	stamp = xmalloc(sizeof(*stamp));
+	stamp->path = strdup(rel_path);
+	stamp->mtime = mtime;
+	stamp->ctime = ctime;
+	g_ptr_array_add(dbi->stamps, stamp);
+	return true;
+}
+
+// queues the song at path to be deleted, and remembers that it is
+// until the writer has committed that.
+static void
+queue_delete(struct db_info *dbi, const char *path)
+{
+	struct pending_delete *pending;
+	size_t len;
+
+	len = strlen(path);
+	pending = xmalloc(sizeof(*pending) + len + 1);
+	memcpy(pending->path, path, len + 1);
+	pending->change = writer_delete(dbi->writer, path);
+	g_hash_table_replace(dbi->deleting, pending->path, pending);
+}
+
+// whether the song at path has a delete the writer hasn't committed.
+static bool
+is_deleting(struct db_info *dbi, const char *path)
+{
+	struct pending_delete *pending;
+
+	pending = g_hash_table_lookup(dbi->deleting, path);
+	if (!pending)
+		return false;
+	if (pending->change > writer_committed(dbi->writer))
+		return true;
+	g_hash_table_remove(dbi->deleting, path);
+	return false;
+}
+
+static gboolean
+is_committed(gpointer key __unused, gpointer val, gpointer committed)
+{
+	struct pending_delete *pending = val;
+	return pending->change <= *(uint64_t *)committed;
+}
+
+// drops the deletes the writer has committed since we last looked.
+static void
+forget_deletes(struct db_info *dbi)
+{
+	uint64_t committed;
+
+	committed = writer_committed(dbi->writer);
+	g_hash_table_foreach_remove(dbi->deleting, is_committed, &committed);
+}
+
+// whether the song at path is in one of the directories the crawl
+// skipped.
+static bool
+in_unchanged_dir(struct db_info *dbi, const char *path)
+{
+	char *dir;
+	bool ret;
+
+	dir = rel_dir(path);
+	ret = g_hash_table_contains(dbi->unchanged, dir);
+	free(dir);
 	return ret;
 }
 
+// songs still in known after the first crawl, other than those in
+// directories it skipped, were deleted while we weren't watching, as
+// were directories still in known_dirs.
+void crawled_cb(struct dirwatch *self)
+{
+	struct db_info *dbi = self->data;
+	GHashTableIter iter;
+	struct known_song *known;
+	struct known_dir *known_dir;
+	struct dir_stamp *stamp;
+	gpointer val;
+
+	g_hash_table_iter_init(&iter, dbi->known);
+	while (g_hash_table_iter_next(&iter, NULL, &val)) {
+		known = val;
+		if (!in_unchanged_dir(dbi, known->path))
+			queue_delete(dbi, known->path);
+	}
+	g_hash_table_iter_init(&iter, dbi->known_dirs);
+	while (g_hash_table_iter_next(&iter, NULL, &val)) {
+		known_dir = val;
+		writer_forget_dir(dbi->writer, known_dir->path);
+	}
+
+	// a directory's stamp mustn't be committed before the changes
+	// to its files, or a crash in between would have the next
+	// crawl skip them.  The writer commits in order, so it's
+	// enough for the stamps to be queued after them.
+	pool_drain(dbi->pool);
+	for (unsigned i = 0; i < dbi->stamps->len; i++) {
+		stamp = g_ptr_array_index(dbi->stamps, i);
+		if (g_hash_table_contains(dbi->failed_dirs, stamp->path))
+			free(stamp->path);
+		else
+			writer_dir(dbi->writer, stamp);
+		free(stamp);
+	}
+	pthread_mutex_lock(&dbi->busy_lock);
+	g_hash_table_destroy(dbi->failed_dirs);
+	dbi->failed_dirs = NULL;
+	pthread_mutex_unlock(&dbi->busy_lock);
+
+	g_hash_table_destroy(dbi->known);
+	g_hash_table_destroy(dbi->known_dirs);
+	g_hash_table_destroy(dbi->unchanged);
+	g_ptr_array_free(dbi->stamps, true);
+	dbi->known = NULL;
+	dbi->known_dirs = NULL;
+	dbi->unchanged = NULL;
+	dbi->stamps = NULL;
+}
+
+// publish whatever the last batch of events changed to readers, once
+// the files in it have all been read.
+void idle_cb(struct dirwatch *self)
+{
+	struct db_info *dbi = self->data;
+	pool_drain(dbi->pool);
+	forget_deletes(dbi);
+	writer_flush(dbi->writer);
+}
+
 void cleanup_cb(struct dirwatch *self)
 {
 	struct db_info *dbi = self->data;
-	sqlite3_finalize(dbi->insert_query);
-	sqlite3_finalize(dbi->update_query);
+	pool_free(dbi->pool);
+	g_hash_table_destroy(dbi->busy);
+	pthread_mutex_destroy(&dbi->busy_lock);
+	g_hash_table_destroy(dbi->deleting);
+	writer_free(dbi->writer);
 	sqlite3_finalize(dbi->modified_query);
-	sqlite3_finalize(dbi->delete_query);
 	sqlite3_close(dbi->db);
 }
 
@@ -117,6 +445,7 @@ static int64_t
 get_last_mtime(sqlite3_stmt *modified_stmt, const char *path)
 {
 	int64_t mtime;
+	uint64_t start;
 	int err;
 
 	err = sqlite3_bind_text(
@@ -130,7 +459,9 @@ get_last_mtime(sqlite3_stmt *modified_stmt, const char *path)
 
 	// if we don't have a record, and its a valid file, then its new
 	// and by definition modified
+	start = metrics_now();
 	err = sqlite3_step(modified_stmt);
+	metrics_stmt(STMT_MODIFIED, start);
 	if (err == SQLITE_ROW)
 		mtime = sqlite3_column_int64(modified_stmt, 0);
 	else
@@ -150,6 +481,7 @@ is_modified_cb(struct dirwatch *self,
 	       const char *file __unused)
 {
 	struct db_info *dbi;
+	struct known_song *known;
 	int64_t last_time;
 	const char *rel_path;;
 	bool ret;
@@ -160,83 +492,100 @@ is_modified_cb(struct dirwatch *self,
 	// rel path is the path under '$dir_name/'
 	rel_path = &path[strlen(self->dir_name) + 1];
 
-	stat(path, &stats);
+	// it's gone already, and we'll hear about that from inotify.
+	if (stat(path, &stats))
+		return false;
 
-	last_time = get_last_mtime(dbi->modified_query, rel_path);
+	if (dbi->known) {
+		known = g_hash_table_lookup(dbi->known, rel_path);
+		last_time = known ? known->modified : -1L;
+		g_hash_table_remove(dbi->known, rel_path);
+	} else {
+		last_time = get_last_mtime(dbi->modified_query, rel_path);
+	}
+	// a delete the writer hasn't committed yet leaves the song's
+	// row where we can see it, so it has to be put back.
+	if (is_deleting(dbi, rel_path))
+		last_time = -1L;
 	ret = stats.st_mtime > last_time;
 
 	// if we have rows in the result, it exists.
 	return ret;
 }
 
+// reads the tags of the file and hands them to the writer.  returns
+// false if they couldn't be read.
 static bool
-song_exists(struct db_info *dbi, const char *const short_path)
-{
-	return get_last_mtime(dbi->modified_query, short_path) != -1L;
-}
-
-void
-process_file(const char *full_path, const char *rel_path, struct db_info *dbi)
+read_tags(struct db_info *dbi, struct tag_job *job)
 {
 	TagLib_File *file;
 	TagLib_Tag *tag;
-	int err;
 	const TagLib_AudioProperties *props;
-	const char *text;
+	struct song_tags song;
 	struct stat stats;
-	sqlite3_stmt *stmt;
-
-	if (song_exists(dbi, rel_path)) {
-		printf("  changed '%s'\n", rel_path);
-		fflush(stdout);
-		stmt = dbi->update_query;
-	} else {
-		printf("  new '%s'\n", rel_path);
-		fflush(stdout);
-		stmt = dbi->insert_query;
-	}
 
-	file = taglib_file_new(full_path);
+	file = taglib_file_new(job->full_path);
 	if (file == NULL) {
 		fprintf(stderr,
 			"%s: WARNING: couldn't open '%s' for reading id3 tags.\n",
-			program_name, full_path);
-		return;
+			program_name, job->full_path);
+		return false;
 	}
 	tag = taglib_file_tag(file);
 	props = taglib_file_audioproperties(file);
 	if (tag == NULL || props == NULL) {
 		fprintf(stderr,
 			"%s: WARNING: couldn't open '%s's tags or props.\n",
-			program_name, full_path);
-		return;
+			program_name, job->full_path);
+		taglib_file_free(file);
+		return false;
 	}
 
-	stat(full_path, &stats);
+	stat(job->full_path, &stats);
 
-	text = taglib_tag_title(tag);
-	sqlite3_bind_text(stmt, 1, text, strlen(text), SQLITE_STATIC);
-	text = taglib_tag_artist(tag);
-	sqlite3_bind_text(stmt, 2, text, strlen(text), SQLITE_STATIC);
-	text = taglib_tag_album(tag);
-	sqlite3_bind_text(stmt, 3, text, strlen(text), SQLITE_STATIC);
-	sqlite3_bind_int(stmt, 4, taglib_tag_track(tag));
-	sqlite3_bind_int(stmt, 5, taglib_audioproperties_length(props));
-	sqlite3_bind_int64(stmt, 6, stats.st_mtime);
-	sqlite3_bind_text(stmt, 7, rel_path, strlen(rel_path), SQLITE_STATIC);
-
-	err = sqlite3_step(stmt);
-	if (err != SQLITE_DONE)
-		exit_msg("command failed: %d - %s (%s)", err, sqlite3_errmsg(dbi->db));
-
-	sqlite3_reset(stmt);
-	sqlite3_clear_bindings(stmt);
+	// the strings are ours, see tags_init
+	song.path = strdup(job->rel_path);
+	song.title = taglib_tag_title(tag);
+	song.artist = taglib_tag_artist(tag);
+	song.album = taglib_tag_album(tag);
+	song.track = taglib_tag_track(tag);
+	song.length = taglib_audioproperties_length(props);
+	song.modified = stats.st_mtime;
+	taglib_file_free(file);
 
-	// free the generated sha256 hex string
-	//free((void *)query_args[6]);
+	writer_put(dbi->writer, &song);
+	return true;
+}
 
-	taglib_tag_free_strings();
-	taglib_file_free(file);
+// runs on one of the pool's threads, reading the file for as long as
+// it keeps changing while we do.
+static void
+tag_routine(struct db_info *dbi, struct tag_job *job)
+{
+	bool again, ok;
+
+	// what changed before we start is in what we're about to read.
+	pthread_mutex_lock(&dbi->busy_lock);
+	job->again = false;
+	pthread_mutex_unlock(&dbi->busy_lock);
+
+	do {
+		ok = read_tags(dbi, job);
+
+		pthread_mutex_lock(&dbi->busy_lock);
+		again = job->again;
+		job->again = false;
+		if (!again) {
+			g_hash_table_remove(dbi->busy, job->rel_path);
+			if (!ok && dbi->failed_dirs)
+				g_hash_table_add(dbi->failed_dirs,
+						 rel_dir(job->rel_path));
+		}
+		pthread_mutex_unlock(&dbi->busy_lock);
+	} while (again);
+
+	free(job->full_path);
+	free(job);
 }
 
 void
@@ -244,14 +593,33 @@ change_cb(struct dirwatch *self, const char *path,
 	  const char *dir __unused, const char *file __unused)
 {
 	struct db_info *dbi;
+	struct tag_job *job;
 	const char *rel_path;
+	size_t len;
 
 	dbi = self->data;
 
 	// rel path is the path under '$dir_name/'
-	rel_path = &path[strlen(self->dir_name) + 1];
-
-	process_file(path, rel_path, dbi);
+	len = strlen(self->dir_name) + 1;
+	rel_path = &path[len];
+
+	// if the file is already queued or being read, have that job
+	// read it again when it's done rather than racing it.
+	pthread_mutex_lock(&dbi->busy_lock);
+	job = g_hash_table_lookup(dbi->busy, rel_path);
+	if (job) {
+		job->again = true;
+		pthread_mutex_unlock(&dbi->busy_lock);
+		return;
+	}
+	job = xmalloc(sizeof(*job));
+	job->full_path = strdup(path);
+	job->rel_path = &job->full_path[len];
+	job->again = false;
+	g_hash_table_insert(dbi->busy, &job->full_path[len], job);
+	pthread_mutex_unlock(&dbi->busy_lock);
+
+	pool_push(dbi->pool, job);
 }
 
 void
@@ -259,34 +627,15 @@ delete_cb(struct dirwatch *self, const char *path,
 	  const char *dir __unused, const char *file __unused)
 {
 	struct db_info *dbi;
-	int err;
 	const char *rel_path;
-	sqlite3_stmt *stmt;
 
 	dbi = self->data;
-	stmt = dbi->delete_query;
 
 	// rel path is the path under '$dir_name/'
 	rel_path = &path[strlen(self->dir_name) + 1];
-	printf("  deleting: '%s'\n", rel_path);
-	fflush(stdout);
-
-	err = sqlite3_bind_text(
-		stmt,
-		1,
-		rel_path,
-		strlen(rel_path),
-		SQLITE_STATIC);
-	if (err != SQLITE_OK)
-		exit_msg("sqlite3_bind: %d\n", err);
-
-	// if we don't have a record, and its a valid file, then its new
-	// and by definition modified
-	err = sqlite3_step(stmt);
-	if (err != SQLITE_DONE)
-		exit_msg("delete failed: %d - %s", err,
-			 sqlite3_errmsg(dbi->db));
 
-	sqlite3_reset(stmt);
-	sqlite3_clear_bindings(stmt);
+	// the reads already queued may be of this file, and have to
+	// get to the writer before the delete does.
+	pool_drain(dbi->pool);
+	queue_delete(dbi, rel_path);
 }
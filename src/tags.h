@@ -7,7 +7,15 @@
 #include "dirwatch.h"
 
 
-void *tags_init(sqlite3 *db);
+// threads reading tags from music files, 0 for one per cpu
+extern int tag_threads;
+// look at every file in the first crawl, even in directories that
+// haven't changed since the last one
+extern bool full_scan;
+
+// takes over db, the writer connection, and opens its own read-only
+// one at db_path to compare files against.
+void *tags_init(sqlite3 *db, const char *db_path);
 
 bool is_valid_cb(struct dirwatch *self,
 		 const char *path,
@@ -17,6 +25,9 @@ bool is_modified_cb(struct dirwatch *self,
 		    const char *path,
 		    const char *dir,
 		    const char *file);
+bool is_dir_modified_cb(struct dirwatch *self,
+			const char *path,
+			const struct stat *st);
 
 void delete_cb(struct dirwatch *self,
 	       const char *path,
@@ -27,6 +38,8 @@ void change_cb(struct dirwatch *self,
 	       const char *dir,
 	       const char *file);
 
+void crawled_cb(struct dirwatch *self);
+void idle_cb(struct dirwatch *self);
 void cleanup_cb(struct dirwatch *self);
 
 #endif // _TAGS_H_
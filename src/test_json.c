@@ -0,0 +1,150 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#include "common.h"
+#include "format.h"
+#include "json.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <check.h>
+
+const char *program_name = "test_json";
+
+// returns s as json_string writes it.  The caller frees it.
+static char *
+quote(const char *s)
+{
+	struct wbuf out;
+
+	wbuf_init(&out, 16);
+	json_string(&out, s);
+	return wbuf_release(&out);
+}
+
+static void
+check_quote(const char *s, const char *want)
+{
+	char *got;
+
+	got = quote(s);
+	ck_assert_str_eq(got, want);
+	free(got);
+}
+
+START_TEST(test_plain)
+{
+	check_quote("", "\"\"");
+	check_quote("Jay-Z", "\"Jay-Z\"");
+	// longer than a vector, so the scan goes past its first block
+	check_quote("The Blueprint 3 (Deluxe Edition) [Disc 2]",
+		    "\"The Blueprint 3 (Deluxe Edition) [Disc 2]\"");
+}
+END_TEST
+
+START_TEST(test_escapes)
+{
+	check_quote("say \"hi\"", "\"say \\\"hi\\\"\"");
+	check_quote("AC\\DC", "\"AC\\\\DC\"");
+	check_quote("a\b\f\n\r\tb", "\"a\\b\\f\\n\\r\\tb\"");
+	check_quote("\x01\x1f", "\"\\u0001\\u001f\"");
+	// the first special byte past a whole plain vector
+	check_quote("0123456789abcdef0123456789abcdef\"",
+		    "\"0123456789abcdef0123456789abcdef\\\"\"");
+	// DEL and '/' need no escaping
+	check_quote("a/\x7f", "\"a/\x7f\"");
+}
+END_TEST
+
+START_TEST(test_utf8)
+{
+	// valid 2, 3 and 4 byte sequences are copied as they are
+	check_quote("Bj\xc3\xb6rk", "\"Bj\xc3\xb6rk\"");
+	check_quote("\xe2\x82\xac", "\"\xe2\x82\xac\"");
+	check_quote("\xf0\x9f\x8e\xb5", "\"\xf0\x9f\x8e\xb5\"");
+	check_quote("\xf4\x8f\xbf\xbf", "\"\xf4\x8f\xbf\xbf\"");
+}
+END_TEST
+
+START_TEST(test_invalid_utf8)
+{
+	// latin-1, and stray continuation bytes
+	check_quote("Bj\xf6rk", "\"Bj\\ufffdrk\"");
+	check_quote("\x80\xbf", "\"\\ufffd\\ufffd\"");
+	// overlong encodings of '/' and of U+20AC
+	check_quote("\xc0\xaf", "\"\\ufffd\\ufffd\"");
+	check_quote("\xe0\x82\xac", "\"\\ufffd\\ufffd\\ufffd\"");
+	check_quote("\xf0\x82\x82\xac", "\"\\ufffd\\ufffd\\ufffd\\ufffd\"");
+	// a surrogate, and past U+10FFFF
+	check_quote("\xed\xa0\x80", "\"\\ufffd\\ufffd\\ufffd\"");
+	check_quote("\xf4\x90\x80\x80", "\"\\ufffd\\ufffd\\ufffd\\ufffd\"");
+	// cut short by the end of the string, or by an ascii byte
+	check_quote("ab\xe2\x82", "\"ab\\ufffd\\ufffd\"");
+	check_quote("\xe2x", "\"\\ufffdx\"");
+}
+END_TEST
+
+// the vector scan reads whole aligned blocks, so a string ending at
+// the end of a page, with nothing mapped after it, must not fault.
+START_TEST(test_page_end)
+{
+	const char *s = "Page End";
+	size_t page, len;
+	char *map, *p, *got;
+
+	page = sysconf(_SC_PAGESIZE);
+	map = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ck_assert(map != MAP_FAILED);
+	ck_assert_int_eq(mprotect(&map[page], page, PROT_NONE), 0);
+
+	// every alignment, with the NUL as the page's last byte
+	len = strlen(s);
+	for (size_t i = 0; i <= len; i++) {
+		p = &map[page - 1 - (len - i)];
+		memcpy(p, &s[i], len - i + 1);
+		got = quote(p);
+		ck_assert_int_eq(strlen(got), len - i + 2);
+		free(got);
+	}
+	// and one that needs escaping right at the end
+	memcpy(&map[page - 3], "a\"", 3);
+	check_quote(&map[page - 3], "\"a\\\"\"");
+
+	munmap(map, 2 * page);
+}
+END_TEST
+
+static Suite *
+json_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("json");
+	tc = tcase_create("string");
+	tcase_add_test(tc, test_plain);
+	tcase_add_test(tc, test_escapes);
+	tcase_add_test(tc, test_utf8);
+	tcase_add_test(tc, test_invalid_utf8);
+	tcase_add_test(tc, test_page_end);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+int
+main(void)
+{
+	SRunner *sr;
+	int failed;
+
+	sr = srunner_create(json_suite());
+	srunner_run_all(sr, CK_NORMAL);
+	failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,127 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#include "common.h"
+#include "pool.h"
+
+#include <sched.h>
+#include <stdlib.h>
+
+#include <check.h>
+
+const char *program_name = "test_pool";
+
+// counts the jobs done, and checks that none is done twice.
+struct tally {
+	uint64_t done;
+	uint8_t *seen;
+};
+
+static void
+count_job(struct tally *self, uintptr_t *job)
+{
+	// a little work, so that jobs overlap on the pool's threads
+	for (int i = *job % 64; i > 0; i--)
+		sched_yield();
+	ck_assert_int_eq(__atomic_fetch_add(&self->seen[*job], 1,
+					    __ATOMIC_RELAXED), 0);
+	__atomic_add_fetch(&self->done, 1, __ATOMIC_RELEASE);
+}
+
+// more jobs than the queue has room for, pushed from this thread
+// while four others take them off it, drained every so often.
+START_TEST(test_push_drain)
+{
+	const int N = 20000;
+	struct tally tally;
+	struct pool *pool;
+	uintptr_t *jobs;
+
+	tally.done = 0;
+	tally.seen = calloc(N, 1);
+	jobs = calloc(N, sizeof(*jobs));
+	pool = pool_new(4, 16, (pool_fn)count_job, &tally);
+
+	for (int i = 0; i < N; i++) {
+		jobs[i] = i;
+		pool_push(pool, &jobs[i]);
+		if (i % 1000 == 999) {
+			pool_drain(pool);
+			ck_assert_int_eq(__atomic_load_n(&tally.done,
+							 __ATOMIC_ACQUIRE),
+					 i + 1);
+		}
+	}
+	pool_free(pool);
+
+	ck_assert_int_eq(tally.done, N);
+	for (int i = 0; i < N; i++)
+		ck_assert_int_eq(tally.seen[i], 1);
+
+	free(jobs);
+	free(tally.seen);
+}
+END_TEST
+
+// a job that finishes after pool_drain has said what it is waiting
+// for, but before it looks, posts drained without anyone waiting on
+// it.  That post mustn't let the next drain return before its own
+// jobs are done.  One job per drain, over and over, makes that
+// happen often.
+START_TEST(test_drain_stale_post)
+{
+	const int N = 20000;
+	struct tally tally;
+	struct pool *pool;
+	uintptr_t *jobs;
+
+	tally.done = 0;
+	tally.seen = calloc(N, 1);
+	jobs = calloc(N, sizeof(*jobs));
+	pool = pool_new(2, 4, (pool_fn)count_job, &tally);
+
+	for (int i = 0; i < N; i++) {
+		jobs[i] = i;
+		pool_push(pool, &jobs[i]);
+		pool_drain(pool);
+		ck_assert_int_eq(__atomic_load_n(&tally.done,
+						 __ATOMIC_ACQUIRE), i + 1);
+	}
+	// and with nothing pushed since, drain doesn't wait at all.
+	pool_drain(pool);
+	pool_free(pool);
+
+	free(jobs);
+	free(tally.seen);
+}
+END_TEST
+
+static Suite *
+pool_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("pool");
+	tc = tcase_create("core");
+	tcase_set_timeout(tc, 60);
+	tcase_add_test(tc, test_push_drain);
+	tcase_add_test(tc, test_drain_stale_post);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+int
+main(void)
+{
+	SRunner *sr;
+	int failed;
+
+	sr = srunner_create(pool_suite());
+	srunner_run_all(sr, CK_NORMAL);
+	failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
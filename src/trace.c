@@ -0,0 +1,125 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#include "common.h"
+#include "trace.h"
+#include "metrics.h"
+#include "utils.h"
+
+#include <stdio.h>
+
+#include <event2/http.h>
+
+#define NS_PER_MS (1000000ULL)
+// log at most one slow request per thread this often
+#define SLOW_LOG_INTERVAL (1000 * NS_PER_MS)
+// room for 'name;dur=123.456, ' per phase
+#define PHASE_LEN (40)
+
+int slow_ms;
+
+// when this thread last logged a slow request, and how many it has
+// skipped since.
+static __thread uint64_t last_logged;
+static __thread int skipped;
+
+void
+trace_start(struct trace *self, struct evhttp_request *req)
+{
+	self->on = false;
+	self->wanted = false;
+	self->start = metrics_now();
+	self->last = self->start;
+	self->len = 0;
+
+	// the request may be freed by the time we know it was slow.
+	if (slow_ms > 0)
+		snprintf(self->uri, sizeof(self->uri), "%s",
+			 evhttp_request_get_uri(req));
+}
+
+void
+trace_want(struct trace *self, bool wanted)
+{
+	self->wanted = wanted;
+	self->on = wanted || slow_ms > 0;
+}
+
+void
+trace_phase(struct trace *self, const char *name)
+{
+	uint64_t now;
+
+	if (!self->on)
+		return;
+
+	now = metrics_now();
+	// past the last slot, everything counts against the last phase.
+	if (self->len < TRACE_PHASES) {
+		self->phases[self->len].name = name;
+		self->phases[self->len].ns = 0;
+		self->len++;
+	}
+	self->phases[self->len - 1].ns += now - self->last;
+	self->last = now;
+}
+
+// writes the phases into buf as 'name<sep>ms<end>' for each.
+static void
+trace_format(struct trace *self, char *buf, size_t len, const char *sep,
+	     const char *end)
+{
+	int n;
+
+	for (int i = 0; i < self->len && len > 1; i++) {
+		n = snprintf(buf, len, "%s%s%.3f%s", self->phases[i].name, sep,
+			     (double)self->phases[i].ns / NS_PER_MS, end);
+		if (n < 0 || (size_t)n >= len)
+			break;
+		buf += n;
+		len -= n;
+	}
+	snprintf(buf, len, "total%s%.3f", sep,
+		 (double)(self->last - self->start) / NS_PER_MS);
+}
+
+void
+trace_header(struct trace *self, struct evhttp_request *req)
+{
+	char buf[(TRACE_PHASES + 1) * PHASE_LEN];
+
+	if (!self->wanted)
+		return;
+
+	trace_format(self, buf, sizeof(buf), ";dur=", ", ");
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+			  "Server-Timing", buf);
+}
+
+void
+trace_finish(struct trace *self)
+{
+	char buf[(TRACE_PHASES + 1) * PHASE_LEN];
+	uint64_t total;
+
+	if (!self->on || slow_ms <= 0)
+		return;
+
+	total = self->last - self->start;
+	if (total < (uint64_t)slow_ms * NS_PER_MS)
+		return;
+
+	// when everything is slow, a sample of the slow requests says
+	// as much as all of them would.
+	if (last_logged && self->last - last_logged < SLOW_LOG_INTERVAL) {
+		skipped++;
+		return;
+	}
+
+	trace_format(self, buf, sizeof(buf), "=", " ");
+	log(WARN, "slow request: %s (ms: %s; %d similar not logged)",
+	    self->uri, buf, skipped);
+
+	last_logged = self->last;
+	skipped = 0;
+}
@@ -0,0 +1,34 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include "common.h"
+
+// traces time the phases of handling an API request on the monotonic
+// clock.  A client can ask for the breakdown with '?trace=1' or an
+// X-Cnote-Trace header, and gets it back in a Server-Timing header.
+// Requests slower than slow_ms are logged along with their breakdown,
+// at most one a second per thread.
+
+#define TRACE_HEADER "X-Cnote-Trace"
+
+// requests that take longer than this many milliseconds are logged,
+// 0 disables.
+extern int slow_ms;
+
+// starts timing req, as soon as we get it.
+void trace_start(struct trace *self, struct evhttp_request *req);
+// once we know whether the client wants the breakdown, decides if
+// the phases are worth recording.
+void trace_want(struct trace *self, bool wanted);
+// ends the phase called name (a string constant), and starts the next.
+void trace_phase(struct trace *self, const char *name);
+// adds the breakdown so far to req's response headers, if the client
+// asked for it.  call just before the reply is sent.
+void trace_header(struct trace *self, struct evhttp_request *req);
+// logs the request if it was slow.  req may be gone by now.
+void trace_finish(struct trace *self);
+
+#endif // _TRACE_H_
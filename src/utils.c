@@ -152,7 +152,7 @@ int set_nonblocking(int fd)
 
 
 int
-get_tcp_socket(const char *addr, const char *port)
+get_tcp_socket(const char *addr, const char *port, bool shared)
 {
 	int sock, err, flag;
 	struct addrinfo hints;
@@ -184,13 +184,22 @@ get_tcp_socket(const char *addr, const char *port)
 			      rp->ai_protocol);
 		if (sock == -1)
 			continue;
+		// SO_REUSEPORT lets several sockets (one per worker
+		// thread) bind the same addr:port, with the kernel
+		// load balancing incoming connections between them.
+		flag = 1;
+		if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &flag,
+			       sizeof(flag)) ||
+		    (shared && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+					  &flag, sizeof(flag))))
+			exit_perr("get_socket: setsockopt");
 		if (bind(sock, rp->ai_addr, rp->ai_addrlen) == 0)
 			break;
 		close(sock);
 	}
 
 	if (rp == NULL || sock == -1)
-		exit_perr("get_socket: couldn't bind");
+		exit_perr("get_socket: couldn't bind %s:%s", addr, port);
 
 	freeaddrinfo(result);
 
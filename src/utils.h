@@ -50,6 +50,12 @@ void exit_perr(const char *msg_fmt, ...);
 // prints msg to stderr and exits, indicating failure
 void exit_msg(const char *msg_fmt, ...);
 
+// returns a non-blocking TCP socket listening on addr:port, bound
+// with SO_REUSEPORT if shared, so that other sockets of ours can bind
+// it too.  exits on failure, such as the port being in use.
+int get_tcp_socket(const char *addr, const char *port, bool shared);
+int set_nonblocking(int fd);
+
 // recursive mkdirr.  non-reentrent.
 int mkdirr(const char *path, mode_t mode);
 
@@ -0,0 +1,597 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#include "common.h"
+#include "catalog.h"
+#include "db.h"
+#include "metrics.h"
+#include "utils.h"
+#include "writer.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// how many changes can be queued before the indexer has to wait for
+// the writer to catch up
+#define QUEUE_MAX (4096)
+
+int commit_rows = 8192;
+int commit_ms = 1000;
+
+// a song's artist and album ids are looked up from their names,
+// which are added to (or updated in) the artists and albums tables
+// first.
+static const char INSERT_QUERY[] =
+	"INSERT INTO music (title, artist, album, track, time, modified, path,"
+	"                   artist_id, album_id)"
+	"    VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7,"
+	"            (SELECT id FROM artists WHERE name = ?2),"
+	"            (SELECT id FROM albums WHERE name = ?3))";
+
+static const char UPDATE_QUERY[] =
+	"UPDATE music SET title = ?1, artist = ?2, album = ?3, track = ?4,"
+	"                 time = ?5, modified = ?6,"
+	"                 artist_id = (SELECT id FROM artists WHERE name = ?2),"
+	"                 album_id = (SELECT id FROM albums WHERE name = ?3)"
+	"    WHERE path = ?7";
+
+static const char EXISTS_QUERY[] =
+	"SELECT 1 FROM music WHERE path = ?";
+
+static const char IDS_QUERY[] =
+	"SELECT artist_id, album_id"
+	"    FROM music WHERE path = ?";
+
+static const char DELETE_QUERY[] =
+	"DELETE FROM music "
+	"    WHERE path = ?";
+
+// artists and albums count their songs, and add up their length.
+// A song is added to its (possibly new) artist and album by name
+// before it is written, and taken away from its old ones, found from
+// the music table by path, before those are overwritten.  Groups go
+// once their last song does; adding before taking away means a group
+// keeps its id when its only song changes.
+#define GROUP_ADD_QUERY(table)						\
+	"INSERT INTO " table " (name, tracks, time) VALUES (?1, 1, ?2)"	\
+	"    ON CONFLICT (name) DO UPDATE"				\
+	"    SET tracks = tracks + 1, time = time + excluded.time"
+
+#define GROUP_DEL_QUERY(table, col)					\
+	"UPDATE " table " SET tracks = tracks - 1,"			\
+	"    time = time - (SELECT ifnull(time, 0) FROM music WHERE path = ?1)" \
+	"    WHERE id = (SELECT " col " FROM music WHERE path = ?1)"
+
+#define GROUP_PRUNE_QUERY(table, col)					\
+	"DELETE FROM " table						\
+	"    WHERE id = (SELECT " col " FROM music WHERE path = ?1)"	\
+	"    AND tracks <= 0"
+
+enum GROUP {
+	GROUP_ARTIST,
+	GROUP_ALBUM,
+	GROUP_MAX,
+};
+
+static const char *const GROUP_QUERIES[GROUP_MAX][3] = {
+	[GROUP_ARTIST] = {
+		GROUP_ADD_QUERY("artists"),
+		GROUP_DEL_QUERY("artists", "artist_id"),
+		GROUP_PRUNE_QUERY("artists", "artist_id"),
+	},
+	[GROUP_ALBUM] = {
+		GROUP_ADD_QUERY("albums"),
+		GROUP_DEL_QUERY("albums", "album_id"),
+		GROUP_PRUNE_QUERY("albums", "album_id"),
+	},
+};
+
+static const char DIR_PUT_QUERY[] =
+	"INSERT INTO dirs (path, mtime, ctime) VALUES (?1, ?2, ?3)"
+	"    ON CONFLICT (path) DO UPDATE"
+	"    SET mtime = excluded.mtime, ctime = excluded.ctime";
+
+static const char DIR_DELETE_QUERY[] =
+	"DELETE FROM dirs WHERE path = ?";
+
+enum WRITE {
+	WRITE_PUT,
+	WRITE_DELETE,
+	WRITE_DIR,
+	WRITE_FORGET_DIR,
+};
+
+// a queued change.  For a delete, only song.path is set, and for
+// forgetting a directory only dir.path.
+struct write {
+	enum WRITE op;
+	union {
+		struct song_tags song;
+		struct dir_stamp dir;
+	};
+	struct write *next;
+};
+
+struct writer {
+	sqlite3 *db;
+	sqlite3_stmt *insert_query;
+	sqlite3_stmt *update_query;
+	sqlite3_stmt *exists_query;
+	sqlite3_stmt *ids_query;
+	sqlite3_stmt *delete_query;
+	sqlite3_stmt *group_add_query[GROUP_MAX];
+	sqlite3_stmt *group_del_query[GROUP_MAX];
+	sqlite3_stmt *group_prune_query[GROUP_MAX];
+	sqlite3_stmt *dir_put_query;
+	sqlite3_stmt *dir_delete_query;
+
+	// how many changes have been applied, and how many of those
+	// have been committed.  Changes are applied in the order they
+	// were queued, so the change writer_delete numbered n is in
+	// the db once committed reaches n.
+	uint64_t applied;
+	uint64_t committed;
+
+	pthread_t tinfo;
+	// everything below is protected by lock.  more is signalled
+	// when there is something for the writer to do, and room when
+	// the queue has been emptied.
+	pthread_mutex_t lock;
+	pthread_cond_t more;
+	pthread_cond_t room;
+	struct write *head;
+	struct write *tail;
+	int len;
+	// how many changes have been queued
+	uint64_t queued;
+	bool flush;
+	bool stop;
+};
+
+void
+song_tags_free(struct song_tags *song)
+{
+	free(song->path);
+	free(song->title);
+	free(song->artist);
+	free(song->album);
+}
+
+// runs a statement that doesn't return rows, with s (a path or a
+// name) as its first argument, and n as its second if it takes one.
+static void
+step_done(struct writer *self, sqlite3_stmt *stmt, enum STMT metric,
+	  const char *s, int n)
+{
+	uint64_t start;
+	int err;
+
+	sqlite3_bind_text(stmt, 1, s, strlen(s), SQLITE_STATIC);
+	if (sqlite3_bind_parameter_count(stmt) > 1)
+		sqlite3_bind_int(stmt, 2, n);
+
+	start = metrics_now();
+	err = sqlite3_step(stmt);
+	metrics_stmt(metric, start);
+	if (err != SQLITE_DONE)
+		exit_msg("'%s' failed: %d - %s", sqlite3_sql(stmt), err,
+			 sqlite3_errmsg(self->db));
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
+
+// takes the song at path away from its artist and album, before it
+// is changed or deleted.
+static void
+groups_del(struct writer *self, const char *path)
+{
+	for (int i = 0; i < GROUP_MAX; i++) {
+		step_done(self, self->group_del_query[i], STMT_GROUPS, path, 0);
+		step_done(self, self->group_prune_query[i], STMT_GROUPS,
+			  path, 0);
+	}
+}
+
+// whether the song at path is in the db, including the changes in
+// the transaction we have open.
+static bool
+song_exists(struct writer *self, const char *path)
+{
+	sqlite3_stmt *stmt;
+	uint64_t start;
+	int err;
+
+	stmt = self->exists_query;
+	sqlite3_bind_text(stmt, 1, path, strlen(path), SQLITE_STATIC);
+	start = metrics_now();
+	err = sqlite3_step(stmt);
+	metrics_stmt(STMT_MODIFIED, start);
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	return err == SQLITE_ROW;
+}
+
+// looks up the artist and album ids the song at path was given.
+static void
+song_ids(struct writer *self, const char *path, int64_t *artist_id,
+	 int64_t *album_id)
+{
+	sqlite3_stmt *stmt;
+	int err;
+
+	stmt = self->ids_query;
+	sqlite3_bind_text(stmt, 1, path, strlen(path), SQLITE_STATIC);
+	err = sqlite3_step(stmt);
+	if (err != SQLITE_ROW)
+		exit_msg("ids lookup failed: %d - %s", err,
+			 sqlite3_errmsg(self->db));
+	*artist_id = sqlite3_column_int64(stmt, 0);
+	*album_id = sqlite3_column_int64(stmt, 1);
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
+
+// writes the song, its full-text index entry and its artist and
+// album, and then puts it in the catalog's working copy.
+static void
+apply_put(struct writer *self, struct song_tags *s)
+{
+	sqlite3_stmt *stmt;
+	int64_t artist_id, album_id;
+	uint64_t start;
+	bool exists;
+	int err;
+
+	exists = song_exists(self, s->path);
+	if (exists) {
+		printf("  changed '%s'\n", s->path);
+		stmt = self->update_query;
+	} else {
+		printf("  new '%s'\n", s->path);
+		stmt = self->insert_query;
+	}
+
+	sqlite3_bind_text(stmt, 1, s->title, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, s->artist, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 3, s->album, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 4, s->track);
+	sqlite3_bind_int(stmt, 5, s->length);
+	sqlite3_bind_int64(stmt, 6, s->modified);
+	sqlite3_bind_text(stmt, 7, s->path, -1, SQLITE_STATIC);
+
+	step_done(self, self->group_add_query[GROUP_ARTIST], STMT_GROUPS,
+		  s->artist, s->length);
+	step_done(self, self->group_add_query[GROUP_ALBUM], STMT_GROUPS,
+		  s->album, s->length);
+	if (exists)
+		groups_del(self, s->path);
+
+	start = metrics_now();
+	err = sqlite3_step(stmt);
+	metrics_stmt(exists ? STMT_UPDATE : STMT_INSERT, start);
+	if (err != SQLITE_DONE)
+		exit_msg("command failed: %d - %s (%s)", err,
+			 sqlite3_errmsg(self->db), s->path);
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	song_ids(self, s->path, &artist_id, &album_id);
+	metrics_indexer(IDX_FILES);
+
+	catalog_put(s->path, s->title, s->artist, s->album, s->track,
+		    s->length, artist_id, album_id);
+}
+
+static void
+apply_delete(struct writer *self, const char *path)
+{
+	printf("  deleting: '%s'\n", path);
+
+	groups_del(self, path);
+	step_done(self, self->delete_query, STMT_DELETE, path, 0);
+	metrics_indexer(IDX_DELETES);
+
+	catalog_remove(path);
+}
+
+static void
+apply_dir(struct writer *self, struct dir_stamp *dir)
+{
+	sqlite3_stmt *stmt;
+	uint64_t start;
+	int err;
+
+	stmt = self->dir_put_query;
+	sqlite3_bind_text(stmt, 1, dir->path, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, dir->mtime);
+	sqlite3_bind_int64(stmt, 3, dir->ctime);
+
+	start = metrics_now();
+	err = sqlite3_step(stmt);
+	metrics_stmt(STMT_DIRS, start);
+	if (err != SQLITE_DONE)
+		exit_msg("dir update failed: %d - %s (%s)", err,
+			 sqlite3_errmsg(self->db), dir->path);
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
+
+// commits the open transaction, and then lets readers see it once
+// enough has changed.
+static void
+commit(struct writer *self)
+{
+	uint64_t start;
+
+	start = metrics_now();
+	db_exec(self->db, "COMMIT");
+	metrics_stmt(STMT_COMMIT, start);
+	__atomic_store_n(&self->committed, self->applied, __ATOMIC_RELEASE);
+	metrics_indexer(IDX_COMMITS);
+	fflush(stdout);
+
+	catalog_publish(false);
+}
+
+static void
+deadline_after(struct timespec *ts, int ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (long)(ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static bool
+deadline_passed(const struct timespec *ts)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > ts->tv_sec ||
+		(now.tv_sec == ts->tv_sec && now.tv_nsec >= ts->tv_nsec);
+}
+
+// writer_routine takes everything queued at once, and applies it in
+// the transaction it has open, starting one if need be.  It commits
+// when the transaction has commit_rows changes in it, when it is
+// commit_ms old, or when it is asked to.
+static void *
+writer_routine(struct writer *self)
+{
+	struct write *batch, *w, *next;
+	struct timespec deadline;
+	bool flush, stop;
+	int rows;
+
+	rows = 0;
+	pthread_mutex_lock(&self->lock);
+	while (true) {
+		while (!self->head && !self->flush && !self->stop) {
+			if (!rows)
+				pthread_cond_wait(&self->more, &self->lock);
+			else if (pthread_cond_timedwait(&self->more, &self->lock,
+							&deadline) == ETIMEDOUT)
+				break;
+		}
+		batch = self->head;
+		self->head = self->tail = NULL;
+		self->len = 0;
+		flush = self->flush;
+		stop = self->stop;
+		self->flush = false;
+		pthread_cond_broadcast(&self->room);
+		pthread_mutex_unlock(&self->lock);
+
+		for (w = batch; w; w = next) {
+			next = w->next;
+			if (!rows) {
+				db_exec(self->db, "BEGIN");
+				deadline_after(&deadline, commit_ms);
+			}
+
+			switch (w->op) {
+			case WRITE_PUT:
+				apply_put(self, &w->song);
+				song_tags_free(&w->song);
+				break;
+			case WRITE_DELETE:
+				apply_delete(self, w->song.path);
+				free(w->song.path);
+				break;
+			case WRITE_DIR:
+				apply_dir(self, &w->dir);
+				free(w->dir.path);
+				break;
+			case WRITE_FORGET_DIR:
+				step_done(self, self->dir_delete_query,
+					  STMT_DIRS, w->dir.path, 0);
+				free(w->dir.path);
+				break;
+			}
+			free(w);
+			self->applied++;
+
+			if (++rows >= commit_rows) {
+				commit(self);
+				rows = 0;
+			}
+		}
+
+		if (rows && (flush || stop || deadline_passed(&deadline))) {
+			commit(self);
+			rows = 0;
+		}
+		if (flush || stop)
+			catalog_publish(true);
+		if (stop)
+			break;
+
+		pthread_mutex_lock(&self->lock);
+	}
+
+	return NULL;
+}
+
+static uint64_t
+enqueue(struct writer *self, struct write *w)
+{
+	uint64_t ret;
+
+	pthread_mutex_lock(&self->lock);
+	while (self->len >= QUEUE_MAX)
+		pthread_cond_wait(&self->room, &self->lock);
+	if (self->tail)
+		self->tail->next = w;
+	else
+		self->head = w;
+	self->tail = w;
+	self->len++;
+	ret = ++self->queued;
+	pthread_cond_signal(&self->more);
+	pthread_mutex_unlock(&self->lock);
+
+	return ret;
+}
+
+void
+writer_put(struct writer *self, struct song_tags *song)
+{
+	struct write *w;
+
+	w = xmalloc(sizeof(*w));
+	w->op = WRITE_PUT;
+	w->song = *song;
+	w->next = NULL;
+	enqueue(self, w);
+}
+
+uint64_t
+writer_delete(struct writer *self, const char *path)
+{
+	struct write *w;
+
+	w = xcalloc(sizeof(*w));
+	w->op = WRITE_DELETE;
+	w->song.path = strdup(path);
+	return enqueue(self, w);
+}
+
+uint64_t
+writer_committed(struct writer *self)
+{
+	return __atomic_load_n(&self->committed, __ATOMIC_ACQUIRE);
+}
+
+void
+writer_dir(struct writer *self, struct dir_stamp *dir)
+{
+	struct write *w;
+
+	w = xmalloc(sizeof(*w));
+	w->op = WRITE_DIR;
+	w->dir = *dir;
+	w->next = NULL;
+	enqueue(self, w);
+}
+
+void
+writer_forget_dir(struct writer *self, const char *path)
+{
+	struct write *w;
+
+	w = xcalloc(sizeof(*w));
+	w->op = WRITE_FORGET_DIR;
+	w->dir.path = strdup(path);
+	enqueue(self, w);
+}
+
+void
+writer_flush(struct writer *self)
+{
+	pthread_mutex_lock(&self->lock);
+	self->flush = true;
+	pthread_cond_signal(&self->more);
+	pthread_mutex_unlock(&self->lock);
+}
+
+struct writer *
+writer_new(sqlite3 *db)
+{
+	struct writer *self;
+	pthread_condattr_t attr;
+	int err;
+
+	self = xcalloc(sizeof(*self));
+	self->db = db;
+
+	PREPARE_QUERY(db, INSERT_QUERY, &self->insert_query);
+	PREPARE_QUERY(db, UPDATE_QUERY, &self->update_query);
+	PREPARE_QUERY(db, EXISTS_QUERY, &self->exists_query);
+	PREPARE_QUERY(db, IDS_QUERY, &self->ids_query);
+	PREPARE_QUERY(db, DELETE_QUERY, &self->delete_query);
+	for (int i = 0; i < GROUP_MAX; i++) {
+		PREPARE_QUERY(db, GROUP_QUERIES[i][0],
+			      &self->group_add_query[i]);
+		PREPARE_QUERY(db, GROUP_QUERIES[i][1],
+			      &self->group_del_query[i]);
+		PREPARE_QUERY(db, GROUP_QUERIES[i][2],
+			      &self->group_prune_query[i]);
+	}
+	PREPARE_QUERY(db, DIR_PUT_QUERY, &self->dir_put_query);
+	PREPARE_QUERY(db, DIR_DELETE_QUERY, &self->dir_delete_query);
+
+	// commit deadlines are on the monotonic clock, so that they
+	// aren't thrown off by changes to the time of day.
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&self->more, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&self->room, NULL);
+
+	err = pthread_create(&self->tinfo, NULL,
+			     (pthread_routine)writer_routine, self);
+	if (err)
+		exit_msg("%s: pthread_create: %d", __func__, err);
+
+	return self;
+}
+
+void
+writer_free(struct writer *self)
+{
+	pthread_mutex_lock(&self->lock);
+	self->stop = true;
+	pthread_cond_signal(&self->more);
+	pthread_mutex_unlock(&self->lock);
+	pthread_join(self->tinfo, NULL);
+
+	sqlite3_finalize(self->insert_query);
+	sqlite3_finalize(self->update_query);
+	sqlite3_finalize(self->exists_query);
+	sqlite3_finalize(self->ids_query);
+	sqlite3_finalize(self->delete_query);
+	for (int i = 0; i < GROUP_MAX; i++) {
+		sqlite3_finalize(self->group_add_query[i]);
+		sqlite3_finalize(self->group_del_query[i]);
+		sqlite3_finalize(self->group_prune_query[i]);
+	}
+	sqlite3_finalize(self->dir_put_query);
+	sqlite3_finalize(self->dir_delete_query);
+	sqlite3_close(self->db);
+
+	pthread_mutex_destroy(&self->lock);
+	pthread_cond_destroy(&self->more);
+	pthread_cond_destroy(&self->room);
+	free(self);
+}
@@ -0,0 +1,66 @@
+// Copyright 2012 Bobby Powers. All rights reserved.
+// Use of this source code is governed by the MIT
+// license that can be found in the LICENSE file.
+#ifndef _WRITER_H_
+#define _WRITER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sqlite3.h>
+
+// a song's tags, as read from its file.  The strings are malloc'd,
+// and belong to whoever holds the struct.
+struct song_tags {
+	// relative to the music dir
+	char *path;
+	char *title;
+	char *artist;
+	char *album;
+	int track;
+	int length;
+	int64_t modified;
+};
+
+// when a directory last changed (see tags.c), in nanoseconds.  path
+// is malloc'd, like a song's.
+struct dir_stamp {
+	char *path;
+	int64_t mtime;
+	int64_t ctime;
+};
+
+// the writer commits once it has made this many changes, or this
+// many milliseconds after the first of them, whichever comes first.
+extern int commit_rows;
+extern int commit_ms;
+
+struct writer;
+
+// starts the thread which applies the indexer's changes to the db in
+// batches, one transaction per batch.  From now on it is the only one
+// to use db, and the only one to touch the catalog's working copy.
+struct writer *writer_new(sqlite3 *db);
+// commits whatever is queued, stops the thread and closes db.
+void writer_free(struct writer *self);
+
+// queues the song to be added to (or updated in) the db, taking the
+// strings in song.  Blocks while the queue is full.
+void writer_put(struct writer *self, struct song_tags *song);
+// queues the song at path to be removed from the db, returning a
+// number for the change which writer_committed will reach once it is
+// committed.
+uint64_t writer_delete(struct writer *self, const char *path);
+// returns how many of the changes queued so far have been committed.
+uint64_t writer_committed(struct writer *self);
+// queues dir's stamp to be recorded, taking its path.
+void writer_dir(struct writer *self, struct dir_stamp *dir);
+// queues the directory at path to be forgotten.
+void writer_forget_dir(struct writer *self, const char *path);
+// asks the writer to commit what it has so far and publish it to
+// readers, without waiting for it to.
+void writer_flush(struct writer *self);
+
+void song_tags_free(struct song_tags *song);
+
+#endif // _WRITER_H_
@@ -0,0 +1,58 @@
+#!/bin/sh
+# Copyright 2012 Bobby Powers. All rights reserved.
+# Use of this source code is governed by the MIT
+# license that can be found in the LICENSE file.
+
+# runs cnote against a synthetic library in a scratch HOME, and load
+# tests each API endpoint.  Run from src/ (make bench does).  Knobs:
+#   BENCH_ARTISTS  artists in the library, each with 4 albums of 12 songs
+#   BENCH_PORT     port for the server
+#   BENCH_THREADS  server worker threads
+#   BENCH_CONNS    client connections
+#   BENCH_SECS     seconds to run for
+#   BENCH_GZIP     if set, ask for gzipped responses
+set -e
+
+ARTISTS=${BENCH_ARTISTS:-500}
+PORT=${BENCH_PORT:-19690}
+THREADS=${BENCH_THREADS:-2}
+CONNS=${BENCH_CONNS:-32}
+SECS=${BENCH_SECS:-10}
+GZIP=${BENCH_GZIP:+-z}
+
+DIR=`mktemp -d -t cnote-bench.XXXXXX`
+PID=
+cleanup() {
+	if [ -n "$PID" ]; then
+		kill $PID 2>/dev/null || true
+		wait $PID 2>/dev/null || true
+	fi
+	rm -rf "$DIR"
+}
+trap cleanup EXIT INT TERM
+
+# the songs' files are empty, but cnote only looks at them to see
+# that they are still there.
+./bench_gen "$DIR/.cnote.db" "$DIR/Music" $ARTISTS
+
+HOME="$DIR" ./cnote -p $PORT -d "$DIR/Music" -t $THREADS &
+PID=$!
+
+# wait for the server to start answering
+tries=0
+until ./bench_load -p $PORT -c 1 -t 1 -d 0.1 /artist >/dev/null 2>&1; do
+	tries=$((tries + 1))
+	if [ $tries -ge 100 ]; then
+		echo "cnote didn't start" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+./bench_load -p $PORT -c $CONNS -t $THREADS -d $SECS $GZIP \
+	/artist \
+	/album \
+	/artist/Artist%200001 \
+	/album/Album%200001-01 \
+	'/search?q=love' \
+	'/complete?prefix=ar'
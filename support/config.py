@@ -99,6 +99,20 @@ class ConfigBuilder:
             new = run_cmd('%s --%s %s' % (program, info, lib)).strip()
             env[info] = existing + ' ' + new
 
+    def optional(self, lib, define):
+        '''
+        Like require, but a missing library isn't an error.  If lib
+        is found, define is set in cflags.  Returns whether it was.
+        '''
+        ret = run_cmd("%s --exists '%s'" % (self.pkg_config, lib),
+                      'returncode')
+        if ret != 0:
+            print >> stderr, 'optional library %s not found' % lib
+            return False
+        self.require(lib)
+        self.append('cflags', '-D%s' % define)
+        return True
+
     def generate(self, fname='config.mk'):
         if self.profile_build:
             self.append('cflags', '-D_PROF')